@@ -0,0 +1,332 @@
+#include <netdb.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <csse2310a3.h>
+#include <csse2310a4.h>
+
+#define EXIT_USAGE_ERROR 1
+#define EXIT_CONNECTION_ERROR 2
+#define EXIT_REQUEST_ERROR 3
+#define OK_STATUS 200
+#define HTTP_PORT_ARG 1
+#define BINARY_PORT_ARG 2
+#define REQUESTS_ARG 3
+#define MIN_ARGUMENTS 3
+#define MAX_ARGUMENTS 4
+#define DEFAULT_REQUESTS 100000
+#define BASE_10 10
+#define KEY_LENGTH 32
+#define PIPELINE_DEPTH 64
+#define MULTI_GET_KEYS 16
+#define PUBLIC_DATABASE_ID 0
+#define BINARY_GET 1
+#define BINARY_PUT 2
+#define BINARY_MULTI_GET 4
+#define BINARY_HEADER_BYTES 12
+#define BINARY_RESPONSE_BYTES 8
+#define NS_PER_SEC 1000000000.0
+#define NS_PER_US 1000.0
+#define VALUE "benchmark-value-0123456789abcdef"
+
+/* Growable buffer of encoded binary protocol requests */
+typedef struct RequestBuffer {
+    char* data;
+    size_t length;
+    size_t capacity;
+} RequestBuffer;
+
+/* check_usage()
+ * −−−−−−−−−−−−−−−
+ * Checks if commandline arguments are valid and prints the usage message
+ * if invalid
+ *
+ * argc: argument count
+ * argv: argument vector
+ *
+ * Returns: the number of requests to send for each benchmark,
+ *          Exit code 1 if arguments are invalid
+ */
+long check_usage(int argc, char** argv) {
+    long requests = DEFAULT_REQUESTS;
+    char* end;
+    if (argc >= MIN_ARGUMENTS && argc <= MAX_ARGUMENTS) {
+	if (argc < MAX_ARGUMENTS) {
+	    return requests;
+	}
+	requests = strtol(argv[REQUESTS_ARG], &end, BASE_10);
+	if (*end == '\0' && requests > 0) {
+	    return requests;
+	}
+    }
+    fprintf(stderr, "Usage: dbbench httpport binaryport [requests]\n");
+    exit(EXIT_USAGE_ERROR);
+}
+
+/* connect_to_server()
+ * −−−−−−−−−−−−−−−
+ * Connects to the server on the given port
+ *
+ * portnum: the port number
+ *
+ * Returns: the connected socket,
+ *          Exit code 2 if the server cannot be connected to
+ */
+int connect_to_server(char* portnum) {
+    struct addrinfo* ai = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET; // Set up for IPv4
+    hints.ai_socktype = SOCK_STREAM;
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    if (getaddrinfo("localhost", portnum, &hints, &ai) ||
+	    connect(server, ai->ai_addr, sizeof(struct sockaddr))) {
+	fprintf(stderr, "dbbench: unable to connect to port %s\n", portnum);
+	exit(EXIT_CONNECTION_ERROR);
+    }
+    freeaddrinfo(ai);
+    return server;
+}
+
+/* now_seconds()
+ * −−−−−−−−−−−−−−−
+ * Returns: the current monotonic time in seconds
+ */
+double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / NS_PER_SEC;
+}
+
+/* report()
+ * −−−−−−−−−−−−−−−
+ * Prints the throughput and average latency of a benchmark
+ *
+ * name: the benchmark name
+ * requests: number of operations performed
+ * seconds: time taken
+ */
+void report(const char* name, long requests, double seconds) {
+    printf("%-28s %10.0f ops/s %8.2f us/op\n", name, requests / seconds,
+	    seconds * NS_PER_SEC / NS_PER_US / requests);
+    fflush(stdout);
+}
+
+/* check_status()
+ * −−−−−−−−−−−−−−−
+ * Exits if a response did not succeed
+ *
+ * status: the response status
+ *
+ * Returns: Exit code 3 if the status is not 200 (OK)
+ */
+void check_status(int status) {
+    if (status != OK_STATUS) {
+	fprintf(stderr, "dbbench: request failed with status %d\n", status);
+	exit(EXIT_REQUEST_ERROR);
+    }
+}
+
+/* bench_http()
+ * −−−−−−−−−−−−−−−
+ * Times PUT then GET requests sent one at a time over one HTTP connection,
+ * parsing each response the way dbclient does
+ *
+ * portnum: the HTTP port number
+ * requests: number of requests of each type to send
+ */
+void bench_http(char* portnum, long requests) {
+    int server = connect_to_server(portnum);
+    FILE* toServer = fdopen(server, "w");
+    FILE* fromServer = fdopen(dup(server), "r");
+    const char* names[] = {"HTTP PUT", "HTTP GET"};
+    for (int op = 0; op < 2; op++) {
+	double start = now_seconds();
+	for (long i = 0; i < requests; i++) {
+	    if (op == 0) {
+		fprintf(toServer, "PUT /public/bench%ld HTTP/1.1\r\n"
+			"Content-Length: %zu\r\n\r\n%s", i, strlen(VALUE),
+			VALUE);
+	    } else {
+		fprintf(toServer, "GET /public/bench%ld HTTP/1.1\r\n\r\n", i);
+	    }
+	    fflush(toServer);
+	    int status;
+	    char* statusExplain, *body;
+	    HttpHeader** headers;
+	    if (get_HTTP_response(fromServer, &status, &statusExplain, 
+		    &headers, &body) != 1) {
+		fprintf(stderr, "dbbench: connection closed\n");
+		exit(EXIT_CONNECTION_ERROR);
+	    }
+	    check_status(status);
+	    free(statusExplain);
+	    free(body);
+	    free_array_of_headers(headers);
+	}
+	report(names[op], requests, now_seconds() - start);
+    }
+    fclose(toServer);
+    fclose(fromServer);
+}
+
+/* put_bytes()
+ * −−−−−−−−−−−−−−−
+ * Appends bytes to a request buffer
+ *
+ * buffer: the request buffer
+ * bytes: the bytes to append
+ * length: number of bytes to append
+ */
+void put_bytes(RequestBuffer* buffer, const void* bytes, size_t length) {
+    if (buffer->length + length > buffer->capacity) {
+	buffer->capacity = (buffer->length + length) * 2;
+	buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+/* put_request()
+ * −−−−−−−−−−−−−−−
+ * Encodes a binary protocol request into a request buffer
+ *
+ * buffer: the request buffer
+ * opcode: the request opcode
+ * key: the key
+ * keyLength: length of the key
+ * value: the value, NULL if none
+ */
+void put_request(RequestBuffer* buffer, uint8_t opcode, const char* key,
+	uint32_t keyLength, const char* value) {
+    uint32_t valueLength = value == NULL ? 0 : strlen(value);
+    uint8_t flags = 0;
+    uint16_t database = htons(PUBLIC_DATABASE_ID);
+    uint32_t networkKeyLength = htonl(keyLength);
+    uint32_t networkValueLength = htonl(valueLength);
+    put_bytes(buffer, &opcode, sizeof(opcode));
+    put_bytes(buffer, &flags, sizeof(flags));
+    put_bytes(buffer, &database, sizeof(database));
+    put_bytes(buffer, &networkKeyLength, sizeof(networkKeyLength));
+    put_bytes(buffer, &networkValueLength, sizeof(networkValueLength));
+    put_bytes(buffer, key, keyLength);
+    put_bytes(buffer, value, valueLength);
+}
+
+/* read_responses()
+ * −−−−−−−−−−−−−−−
+ * Reads binary protocol responses, checking they succeeded
+ *
+ * fromServer: file stream reading from the server
+ * count: number of responses to read
+ */
+void read_responses(FILE* fromServer, int count) {
+    static char* value = NULL;
+    static size_t capacity = 0;
+    for (int i = 0; i < count; i++) {
+	unsigned char header[BINARY_RESPONSE_BYTES];
+	if (fread(header, sizeof(header), 1, fromServer) != 1) {
+	    fprintf(stderr, "dbbench: connection closed\n");
+	    exit(EXIT_CONNECTION_ERROR);
+	}
+	uint16_t status;
+	uint32_t length;
+	memcpy(&status, header, sizeof(status));
+	memcpy(&length, header + sizeof(uint32_t), sizeof(length));
+	check_status(ntohs(status));
+	length = ntohl(length);
+	if (length > capacity) {
+	    capacity = length;
+	    value = realloc(value, capacity);
+	}
+	if (length > 0 && fread(value, length, 1, fromServer) != 1) {
+	    fprintf(stderr, "dbbench: connection closed\n");
+	    exit(EXIT_CONNECTION_ERROR);
+	}
+    }
+}
+
+/* bench_binary()
+ * −−−−−−−−−−−−−−−
+ * Times binary protocol PUT and GET requests, sending batches of depth
+ * requests before reading their responses (depth 1 is one at a time)
+ *
+ * portnum: the binary protocol port number
+ * requests: number of requests of each type to send
+ * depth: number of requests pipelined at once
+ */
+void bench_binary(char* portnum, long requests, int depth) {
+    int server = connect_to_server(portnum);
+    FILE* fromServer = fdopen(dup(server), "r");
+    RequestBuffer buffer = {NULL, 0, 0};
+    char key[KEY_LENGTH];
+    for (int op = 0; op < 2; op++) {
+	double start = now_seconds();
+	for (long i = 0; i < requests; i += depth) {
+	    buffer.length = 0;
+	    int batch = 0;
+	    for (; batch < depth && i + batch < requests; batch++) {
+		int keyLength = sprintf(key, "bench%ld", i + batch);
+		put_request(&buffer, op == 0 ? BINARY_PUT : BINARY_GET, key,
+			keyLength, op == 0 ? VALUE : NULL);
+	    }
+	    write(server, buffer.data, buffer.length);
+	    read_responses(fromServer, batch);
+	}
+	char name[KEY_LENGTH];
+	sprintf(name, "binary %s (depth %d)", op == 0 ? "PUT" : "GET", depth);
+	report(name, requests, now_seconds() - start);
+    }
+    free(buffer.data);
+    fclose(fromServer);
+    close(server);
+}
+
+/* bench_multi_get()
+ * −−−−−−−−−−−−−−−
+ * Times binary protocol multi-get requests of MULTI_GET_KEYS keys each
+ *
+ * portnum: the binary protocol port number
+ * requests: number of keys to get in total
+ */
+void bench_multi_get(char* portnum, long requests) {
+    int server = connect_to_server(portnum);
+    FILE* fromServer = fdopen(dup(server), "r");
+    RequestBuffer keys = {NULL, 0, 0};
+    RequestBuffer request = {NULL, 0, 0};
+    char key[KEY_LENGTH];
+    double start = now_seconds();
+    for (long i = 0; i < requests; i += MULTI_GET_KEYS) {
+	keys.length = 0;
+	for (long j = i; j < i + MULTI_GET_KEYS && j < requests; j++) {
+	    uint32_t keyLength = sprintf(key, "bench%ld", j);
+	    uint32_t networkKeyLength = htonl(keyLength);
+	    put_bytes(&keys, &networkKeyLength, sizeof(networkKeyLength));
+	    put_bytes(&keys, key, keyLength);
+	}
+	request.length = 0;
+	put_request(&request, BINARY_MULTI_GET, keys.data, keys.length, NULL);
+	write(server, request.data, request.length);
+	read_responses(fromServer, 1);
+    }
+    char name[KEY_LENGTH];
+    sprintf(name, "binary multi-get (%d keys)", MULTI_GET_KEYS);
+    report(name, requests, now_seconds() - start);
+    free(keys.data);
+    free(request.data);
+    fclose(fromServer);
+    close(server);
+}
+
+int main(int argc, char** argv) {
+    long requests = check_usage(argc, argv);
+    bench_http(argv[HTTP_PORT_ARG], requests);
+    bench_binary(argv[BINARY_PORT_ARG], requests, 1);
+    bench_binary(argv[BINARY_PORT_ARG], requests, PIPELINE_DEPTH);
+    bench_multi_get(argv[BINARY_PORT_ARG], requests);
+    exit(EXIT_SUCCESS);
+}
@@ -8,10 +8,23 @@
 #include <pthread.h>
 #include <stringstore.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <strings.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <poll.h>
 
 #define EXIT_USAGE_ERROR 1
 #define EXIT_AUTHFILE_ERROR 2
 #define EXIT_SOCKET_ERROR 3
+#define EXIT_DATABASES_ERROR 4
+#define EXIT_HANDOVER_ERROR 5
+#define EXIT_SNAPSHOT_ERROR 6
 #define MIN_ARGUMENTS 3
 #define MAX_ARGUMENTS 4
 #define AUTHFILE_ARG 1
@@ -24,6 +37,17 @@
 #define MAX_URL_LENGTH 3
 #define BASE_10 10
 #define NO_BODY "0"
+#define MAX_PENDING_CLIENTS 32
+#define CLIENT_TIMEOUT_SECS 30
+#define PENDING_TIMEOUT_MS (CLIENT_TIMEOUT_SECS * 1000)
+#define MS_PER_SEC 1000
+#define NS_PER_MS 1000000
+#define DATABASE_ARG 1
+#define DATABASE_BUCKETS 64
+#define MAX_DATABASES 1024
+#define OPTION_PREFIX "--"
+#define PUBLIC_DATABASE "public"
+#define PRIVATE_DATABASE "private"
 
 #define OK_STATUS 200
 #define OK_EXPLAIN "OK"
@@ -37,40 +61,337 @@
 #define UNAUTHORIZED_EXPLAIN "Unauthorized"
 #define UNAVAILABLE_STATUS 503
 #define UNAVAILABLE_EXPLAIN "Service Unavailable"
+#define NOT_MODIFIED_STATUS 304
+#define NOT_MODIFIED_EXPLAIN "Not Modified"
+#define PRECONDITION_FAILED_STATUS 412
+#define PRECONDITION_FAILED_EXPLAIN "Precondition Failed"
+#define ETAG_LENGTH 24
+#define INT64_LENGTH 21
+#define CONFLICT_STATUS 409
+#define CONFLICT_EXPLAIN "Conflict"
+#define INCREMENT_OP "incr"
+#define APPEND_OP "append"
+#define METHOD_NOT_ALLOWED_STATUS 405
+#define METHOD_NOT_ALLOWED_EXPLAIN "Method Not Allowed"
+#define REPLICATE_ADDRESS "/_replicate"
+#define OFFSET_PARAMETER "offset="
+#define LOG_ID_PARAMETER "log="
+#define REPLICATION_LOG_SIZE 65536
+#define REPLICATION_LOG_BYTES (64 * 1024 * 1024)
+#define MAX_BATCH_RECORDS 256
+#define MAX_FRAME_BYTES 65536
+#define HEARTBEAT_SECS 1
+#define REPLICA_TIMEOUT_SECS 5
+#define REPLICA_RETRY_SECS 1
+#define CHANGE_PUT 1
+#define CHANGE_DELETE 2
+#define SNAPSHOT_BEGIN 3
+#define SNAPSHOT_END 4
+#define DATABASE_RECORD 5
+#define CHANGE_BATCH 6
+#define DATABASE_PROTECTED "1"
+#define BINARY_GET 1
+#define BINARY_PUT 2
+#define BINARY_DELETE 3
+#define BINARY_MULTI_GET 4
+#define BINARY_RESOLVE 5
+#define BINARY_AUTH 6
+#define BINARY_CREATE_FLAG 1
+#define BINARY_HEADER_BYTES 12
+#define BINARY_RESPONSE_BYTES 8
+#define BINARY_MISSING_VALUE UINT32_MAX
+#define MAX_BINARY_REQUEST_BYTES (64 * 1024 * 1024)
+#define EPOCH_STRIPES 256
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 1024
+#define SKETCH_SAMPLE_RATE 8
+#define SKETCH_DECAY_INTERVAL 4096
+#define HOT_KEY_THRESHOLD 8
+#define THREAD_CACHE_SIZE 64
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+#define DRAIN_TIMEOUT_SECS 10
+#define DRAIN_POLL_MS 100
+#define MAX_HANDOVER_SOCKETS 2
+#define POLL_SHUTDOWN 0
+#define POLL_HTTP 1
+#define POLL_BINARY 2
+#define POLL_HANDOVER 3
+#define POLL_COUNT 4
+#define SNAPSHOT_TEMP_SUFFIX ".tmp"
+#define SNAPSHOT_MODE 0600
+#define TRACE_ADDRESS "/_trace"
+#define TRACE_COUNT_PARAMETER "n="
+#define TRACE_RING_SIZE 256
+#define DEFAULT_TRACE_COUNT 20
+#define MAX_TRACE_METHOD 8
+#define MAX_TRACE_ADDRESS 48
+#define NS_PER_US 1000
+#define TRACE_START 0
+#define TRACE_PARSED 1
+#define TRACE_LOCKED 2
+#define TRACE_RESPONDING 3
+#define TRACE_RESPONDED 4
+#define TRACE_END 5
+#define TRACE_MARKS 6
+#define EXPORT_KEY "_export"
+#define IMPORT_KEY "_import"
+#define EXPORT_SCAN_BUCKETS 1024
+#define SNAPSHOT_SCAN_BUCKETS 1024
+#define IMPORT_BATCH_RECORDS 4096
+#define IMPORT_BATCH_BYTES (4 * 1024 * 1024)
+#define HEX_BASE 16
 
 /* Command line arguments passed when creating dbserver */
 typedef struct ServerParameters {
     char* authString;
     int connections;
     char* portnum;
+    char* databaseFile;
+    char* replicaOf;
+    char* binaryPort;
+    char* handoverPath;
+    char* snapshotPath; // data is saved here on shutdown, NULL if not
+    int traceRate; // one in traceRate requests is traced, 0 for none
 } ServerParameters;
 
 /* The server statistics */
 typedef struct ServerStats {
     int connected;
     int completed;
+    int queued;
+    int rejected;
+    int timeouts;
+    long queueWaitTotalMs;
+    long queueWaitMaxMs;
+    pthread_mutex_t lock;
+} ServerStats;
+
+/* A change to a database, as streamed to replicas. PUT records carry the 
+ * full resulting value so replaying records is idempotent. BATCH records
+ * hold many changes, already encoded by put_change(), as their value. */
+typedef struct ChangeRecord {
+    uint64_t seq;
+    uint64_t version; // version the key was written at, 0 for DELETE
+    int type;
+    char* database;
+    char* key; // NULL for BATCH records
+    char* value; // NULL for DELETE records
+    size_t valueLength;
+    size_t size; // bytes held by the key and value
+} ChangeRecord;
+
+/* Ordered log of the most recent changes to all databases, held in a ring
+ * buffer indexed by sequence number. Replicas stream the log from the
+ * offset (last sequence number) they have applied. The oldest records are
+ * dropped to keep the log within REPLICATION_LOG_BYTES. */
+typedef struct ReplicationLog {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    ChangeRecord records[REPLICATION_LOG_SIZE];
+    uint64_t nextSeq;
+    int count;
+    size_t bytes; // bytes held by the records in the log
+    char id[INT64_LENGTH]; // identifies this log across server restarts
+    int closed; // set at shutdown, streams end once replicas catch up
+} ReplicationLog;
+
+/* Growable byte buffer used to encode and decode replication frames */
+typedef struct ByteBuffer {
+    char* data;
+    size_t length;
+    size_t capacity;
+    size_t frameStart;
+} ByteBuffer;
+
+/* State of a client connection using the binary protocol */
+typedef struct BinaryConnection {
+    ByteBuffer input;
+    ByteBuffer output;
+    unsigned char authorized[MAX_DATABASES]; // databases passed AUTH for
+} BinaryConnection;
+
+/* Count-min sketch estimating how often each key of a database is read,
+ * from a sample of GET requests. Counts are halved every 
+ * SKETCH_DECAY_INTERVAL samples so that keys which cool down stop being
+ * hot. */
+typedef struct CountMinSketch {
+    uint32_t counts[SKETCH_DEPTH][SKETCH_WIDTH];
+    uint32_t samples;
+    uint32_t requests; // GETs seen by every thread, for sampling
+} CountMinSketch;
+
+/* A named database instance with its own lock and statistics */
+typedef struct Database {
+    char* name;
+    char* authString; // NULL if the database needs no authorization
+    StringStore* store;
+    // Snapshot being received, swapped in for the store once complete so
+    // clients keep being served the old data meanwhile. NULL if none.
+    StringStore* staged;
+    pthread_mutex_t lock;
     int authFails;
     int getOps;
     int putOps;
     int deleteOps;
-} ServerStats;
+    int postOps;
+    int id; // index of the database in the binary protocol
+    CountMinSketch sketch; // read frequency of keys, for the hot key cache
+    // Bumped on every change to a key hashing to the stripe, so cached 
+    // copies can be validated without taking the lock
+    uint64_t epochs[EPOCH_STRIPES];
+    ReplicationLog* log; // log changes are recorded in, NULL if none
+    struct Database* next; // next database in the same hash bucket
+} Database;
+
+/* Hash map from database name to database instance. The map lock is only
+ * held to look up or create databases, never during store operations. */
+typedef struct DatabaseMap {
+    pthread_rwlock_t lock;
+    Database* buckets[DATABASE_BUCKETS];
+    Database* byId[MAX_DATABASES];
+    int count;
+    ReplicationLog* log;
+    int readOnly; // replicas only accept GET requests
+    int staging; // a snapshot is being received into the staged stores
+    pthread_mutex_t cachesLock;
+    struct ThreadCache* caches; // every thread cache, including unused ones
+} DatabaseMap;
+
+/* A value of a hot key, cached by one client handling thread */
+typedef struct CachedValue {
+    Database* database; // NULL if the entry is empty
+    char* key;
+    char* value;
+    uint64_t version;
+    uint64_t epoch; // epoch of the key's stripe when the value was cached
+    unsigned int stripe;
+} CachedValue;
+
+/* Read-only cache of hot key values private to a client handling thread.
+ * Entries are direct-mapped by hash of database and key. Caches are kept
+ * when their thread finishes, for the next thread to reuse, as their 
+ * entries stay valid and their hit counts are part of the statistics. */
+typedef struct ThreadCache {
+    CachedValue entries[THREAD_CACHE_SIZE];
+    // GETs served from the cache by database id. Only written by the 
+    // owning thread, but read atomically by the statistics.
+    unsigned int hits[MAX_DATABASES];
+    int inUse; // 1 while owned by a client handling thread
+    struct ThreadCache* next;
+} ThreadCache;
+
+/* Times (monotonic nanoseconds) at which one sampled request reached the
+ * end of each phase, starting from when the request had been read. Marks
+ * for phases the request skipped (such as locking, for cached GETs) are 0.
+ */
+typedef struct RequestTrace {
+    uint64_t marks[TRACE_MARKS];
+    char method[MAX_TRACE_METHOD];
+    char address[MAX_TRACE_ADDRESS];
+} RequestTrace;
+
+/* The most recent sampled requests of a client handling thread. Only the
+ * owning thread records traces, so the lock is only contended while 
+ * traces are being dumped. */
+typedef struct TraceRing {
+    pthread_mutex_t lock;
+    RequestTrace records[TRACE_RING_SIZE];
+    uint64_t count; // requests recorded in total
+    unsigned int requests; // requests seen, for sampling
+    int inUse; // 1 while owned by a client handling thread
+    struct TraceRing* next;
+} TraceRing;
+
+/* Every trace ring. Rings are kept when their thread finishes, for the 
+ * next thread to reuse, so their traces can still be dumped. */
+typedef struct Tracer {
+    pthread_mutex_t lock;
+    int sampleRate; // one in sampleRate requests is traced, 0 for none
+    char* authString; // required to dump traces, as they reveal keys
+    TraceRing* rings;
+} Tracer;
+
+/* A connection accepted while all connection slots were in use */
+typedef struct PendingClient {
+    int client;
+    int binary;
+    struct timespec queuedAt;
+} PendingClient;
+
+/* Outcome of admitting a newly accepted connection */
+typedef enum AdmitResult {
+    ADMIT_RUN,
+    ADMIT_QUEUED,
+    ADMIT_REJECT
+} AdmitResult;
+
+/* Admission control state shared by the accepting and client threads.
+ * Connections beyond the limit wait in a bounded ring buffer and are
+ * picked up by client threads as they finish, rather than spawning more
+ * threads. */
+typedef struct Admission {
+    pthread_mutex_t lock;
+    pthread_cond_t idle; // signalled whenever a connection slot is released
+    int limit;
+    int active;
+    int draining; // set once the server stops accepting connections
+    int* clients; // sockets of clients being served
+    int clientCount;
+    int clientCapacity;
+    PendingClient pending[MAX_PENDING_CLIENTS];
+    int head;
+    int count;
+    char* rejectResponse;
+    char binaryRejectResponse[BINARY_RESPONSE_BYTES];
+} Admission;
 
 /* Arguments to be passed into client handling thread */
 typedef struct ThreadParameters {
     int client;
-    StringStore* public;
-    StringStore* private;
-    char* authString;
+    int binary; // 1 if the client uses the binary protocol, 0 for HTTP
+    ThreadCache* cache;
+    DatabaseMap* databases;
     ServerStats* stats;
-    pthread_mutex_t lock;
+    Admission* admission;
+    Tracer* tracer;
+    TraceRing* traces; // NULL if tracing is disabled
+    char* authString; // the server's authorization string
 } ThreadParameters;
 
+/* Arguments to be passed into the thread streaming changes to a replica */
+typedef struct StreamParameters {
+    DatabaseMap* databases;
+    Admission* admission;
+    char* address; // the replication request address URL
+    int toReplica;
+} StreamParameters;
+
+/* Arguments to be passed into the thread replicating from a primary */
+typedef struct ReplicaParameters {
+    char* host;
+    char* port;
+    DatabaseMap* databases;
+    uint64_t offset;
+    char* logId; // id of the primary's log the offset is in, NULL if none
+    char* primaryLogId; // id of the log the primary is currently sending
+    char* authString; // sent to the primary, which requires its own
+} ReplicaParameters;
+
 /* Arguments to be passed into signal handling thread */
 typedef struct SigParameters {
     sigset_t set;
     ServerStats* stats;
+    DatabaseMap* databases;
+    Tracer* tracer;
+    int shutdownPipe; // written to on SIGTERM to stop accepting connections
 } SigParameters;
 
+/* The trace being recorded by the current thread, NULL if the request 
+ * being served was not sampled. Thread local so that the response sending
+ * functions can mark phases without every caller passing it through. */
+static __thread RequestTrace* activeTrace = NULL;
+
 /* usage_error()
  * −−−−−−−−−−−−−−−
  * Exits the program with the usage error message
@@ -78,7 +399,10 @@ typedef struct SigParameters {
  * Returns: Exit code 1
  */
 void usage_error(void) {
-    fprintf(stderr, "Usage: dbserver authfile connections [portnum]\n");
+    fprintf(stderr, "Usage: dbserver [--databases dbfile] "
+	    "[--replica-of host:port] [--binary-port portnum] "
+	    "[--handover path] [--snapshot path] [--trace rate] authfile "
+	    "connections [portnum]\n");
     exit(EXIT_USAGE_ERROR);
 }
 
@@ -98,6 +422,76 @@ int digits_only(const char* string) {
     }
 }
 
+/* valid_portnum()
+ * −−−−−−−−−−−−−−−
+ * Determines if a given string is a port number the server can listen on
+ * 
+ * portnum: the string to check
+ *
+ * Returns: 1 if the port number is 0 or in the valid range, 0 otherwise
+ */
+int valid_portnum(const char* portnum) {
+    return strcmp(portnum, "0") == 0 || (digits_only(portnum) && 
+	    atoi(portnum) >= MIN_PORTNUM && atoi(portnum) <= MAX_PORTNUM);
+}
+
+/* process_options()
+ * −−−−−−−−−−−−−−−
+ * Extracts the optional "--name value" arguments given before the 
+ * positional arguments. The argument vector is advanced past them so that
+ * positional arguments keep their usual indices.
+ * 
+ * argc: argument count, updated to exclude options
+ * argv: argument vector, updated to exclude options
+ * parameters: the parameters to populate
+ *
+ * Returns: Exit code 1 if an invalid option is given
+ */
+void process_options(int* argc, char*** argv, ServerParameters* parameters) {
+    parameters->databaseFile = NULL;
+    parameters->replicaOf = NULL;
+    parameters->binaryPort = NULL;
+    parameters->handoverPath = NULL;
+    parameters->snapshotPath = NULL;
+    parameters->traceRate = 0;
+    int i = 1;
+    while (i < *argc && strncmp((*argv)[i], OPTION_PREFIX, 
+	    strlen(OPTION_PREFIX)) == 0) {
+	// Every option takes exactly one value
+	if (i + 1 >= *argc) {
+	    usage_error();
+	}
+	char* option = (*argv)[i];
+	char* value = (*argv)[i + 1];
+	if (strcmp(option, "--databases") == 0 && 
+		parameters->databaseFile == NULL) {
+	    parameters->databaseFile = value;
+	} else if (strcmp(option, "--replica-of") == 0 && 
+		parameters->replicaOf == NULL && strchr(value, ':') != NULL) {
+	    parameters->replicaOf = value;
+	} else if (strcmp(option, "--binary-port") == 0 && 
+		parameters->binaryPort == NULL && valid_portnum(value)) {
+	    parameters->binaryPort = value;
+	} else if (strcmp(option, "--handover") == 0 && 
+		parameters->handoverPath == NULL) {
+	    parameters->handoverPath = value;
+	} else if (strcmp(option, "--snapshot") == 0 && 
+		parameters->snapshotPath == NULL) {
+	    parameters->snapshotPath = value;
+	} else if (strcmp(option, "--trace") == 0 && 
+		parameters->traceRate == 0 && digits_only(value) && 
+		atoi(value) > 0) {
+	    parameters->traceRate = atoi(value);
+	} else {
+	    usage_error();
+	}
+	i += 2;
+    }
+    // Skip the options while keeping the program name at index 0
+    *argc -= i - 1;
+    *argv += i - 1;
+}
+
 /* process_command_arguments()
  * −−−−−−−−−−−−−−−
  * Checks and extracts command line arguments provided.
@@ -112,6 +506,7 @@ int digits_only(const char* string) {
  */
 ServerParameters process_command_arguments(int argc, char** argv) {
     ServerParameters parameters;
+    process_options(&argc, &argv, &parameters);
     // Check number if command line arguments is correctly supplied
     if (argc < MIN_ARGUMENTS || argc > MAX_ARGUMENTS) {
 	usage_error();
@@ -129,9 +524,7 @@ ServerParameters process_command_arguments(int argc, char** argv) {
     parameters.portnum = DEFAULT_PORTNUM;
     if (argc == MAX_ARGUMENTS) {
 	char* portnum = argv[PORTNUM_ARG];
-	if (strcmp(portnum, "0") == 0 || (digits_only(portnum) && 
-		atoi(portnum) >= MIN_PORTNUM && 
-		atoi(portnum) <= MAX_PORTNUM)) {
+	if (valid_portnum(portnum)) {
 	    parameters.portnum = portnum;
 	} else {
 	    usage_error();
@@ -199,14 +592,71 @@ int setup_listen(char* portnum, int connections) {
  */
 HttpHeader** construct_empty_headers() {
     HttpHeader* header = malloc(sizeof(HttpHeader));
-    HttpHeader** headers = malloc(sizeof(HttpHeader*) + 1);
+    HttpHeader** headers = malloc(sizeof(HttpHeader*) * 2);
     header->name = "Content-Length";
     headers[0] = header; // Set 1st elem of header array to the header created
+    headers[1] = NULL; // Header array is NULL terminated
     header->value = NO_BODY;
 
     return headers;
 }
 
+/* construct_etag_headers()
+ * −−−−−−−−−−−−−−−
+ * Constructs HTTP response headers for no body with an ETag
+ *
+ * etag: the ETag header value
+ *
+ * Returns: HTTP response headers
+ */
+HttpHeader** construct_etag_headers(char* etag) {
+    HttpHeader** headers = construct_empty_headers();
+    HttpHeader* header = malloc(sizeof(HttpHeader));
+    header->name = "ETag";
+    header->value = etag;
+    headers = realloc(headers, sizeof(HttpHeader*) * 3);
+    headers[1] = header;
+    headers[2] = NULL;
+    return headers;
+}
+
+/* free_response_headers()
+ * −−−−−−−−−−−−−−−
+ * Frees HTTP response headers constructed by the server. The names and 
+ * values are not owned by the headers.
+ *
+ * headers: HTTP response headers
+ */
+void free_response_headers(HttpHeader** headers) {
+    for (int i = 0; headers[i] != NULL; i++) {
+	free(headers[i]);
+    }
+    free(headers);
+}
+
+/* now_ns()
+ * −−−−−−−−−−−−−−−
+ * Returns: the current monotonic time in nanoseconds
+ */
+uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * MS_PER_SEC * NS_PER_MS + now.tv_nsec;
+}
+
+/* trace_mark()
+ * −−−−−−−−−−−−−−−
+ * Marks the end of a phase of the request being traced by this thread, if 
+ * any. Costs one thread local load when the request is not traced.
+ *
+ * mark: the phase that ended
+ */
+void trace_mark(int mark) {
+    if (activeTrace != NULL) {
+	activeTrace->marks[mark] = now_ns();
+    }
+}
+
 /* send_empty_http_response()
  * −−−−−−−−−−−−−−−
  * Sends a HTTP response with the specified status with no body
@@ -216,364 +666,3551 @@ HttpHeader** construct_empty_headers() {
  * toClient: file descriptor writing to connected client
  */
 void send_empty_http_response(int status, char* statusExplain, int toClient) {
+    trace_mark(TRACE_RESPONDING);
     HttpHeader** headers = construct_empty_headers();
     char* response = construct_HTTP_response(status, statusExplain, 
 	    headers, NULL);
     write(toClient, response, strlen(response));
+    trace_mark(TRACE_RESPONDED);
+    free(response);
+    free_response_headers(headers);
 }
 
-/* process_get_request()
+/* send_etag_http_response()
  * −−−−−−−−−−−−−−−
- * Processes GET requests from the client and sends back the 
- * HTTP response based on the operation
+ * Sends a HTTP response with the specified status and ETag with no body
  * 
- * stats: the server statistics
- * store: database API
+ * status: HTTP response status code
+ * statusExplain: HTTP response status message
+ * version: version of the key the ETag is for
  * toClient: file descriptor writing to connected client
- * key: the value's key in the database
  */
-void process_get_request(ServerStats* stats, struct StringStore* store, 
-	int toClient, char* key) {
-    char* response;
-    const char* value;
-
-    HttpHeader** headers = construct_empty_headers();
-    value = stringstore_retrieve(store, key);
-
-    // Send HTTP response based on value retrieved
-    if (value == NULL) {
-    	response = construct_HTTP_response(NOT_FOUND_STATUS, 
-		NOT_FOUND_EXPLAIN, headers, NULL);
-    } else {
-	// Get content length by converting int to string
-	int valueLength = strlen(value);
-	char contentLength[sizeof(int) + 1];
-	sprintf(contentLength, "%d", valueLength);
-
-	headers[0]->value = contentLength;
-	response = construct_HTTP_response(OK_STATUS, 
-		OK_EXPLAIN, headers, value);
-	stats->getOps++; // successful GET request processed
-    }
+void send_etag_http_response(int status, char* statusExplain, 
+	uint64_t version, int toClient) {
+    trace_mark(TRACE_RESPONDING);
+    char etag[ETAG_LENGTH];
+    sprintf(etag, "\"%" PRIu64 "\"", version);
+    HttpHeader** headers = construct_etag_headers(etag);
+    char* response = construct_HTTP_response(status, statusExplain, 
+	    headers, NULL);
     write(toClient, response, strlen(response));
+    trace_mark(TRACE_RESPONDED);
+    free(response);
+    free_response_headers(headers);
 }
 
-/* process_put_request()
+/* find_header()
  * −−−−−−−−−−−−−−−
- * Processes PUT requests from the client and sends back the
- * HTTP response based on the operation
+ * Finds a header in a HTTP request. Header names are case insensitive.
  * 
- * stats: the server statistics
- * store: database API
- * toClient: file descriptor writing to connected client
- * key: the value's key in the database
- * valueToUpdate: the key's value in the database
+ * headers: the HTTP request headers
+ * name: the header name
+ *
+ * Returns: the header value, NULL if the header is not present
  */
-void process_put_request(ServerStats* stats, struct StringStore* store,
-	int toClient, char* key, char* valueToUpdate) {
-    int status;
-    char* statusExplain;
-    
-    // Get status code and explanation based on if the operation succeeds
-    int err;
-    if ((err = stringstore_add(store, key, valueToUpdate)) == 0) {
-	status = INTERNAL_ERROR_STATUS;
-	statusExplain = INTERNAL_ERROR_EXPLAIN;
-    } else {
-	status = OK_STATUS;
-	statusExplain = OK_EXPLAIN;
-	stats->putOps++; // successful PUT request processed
+char* find_header(HttpHeader** headers, const char* name) {
+    for (int i = 0; headers[i] != NULL; i++) {
+	if (strcasecmp(headers[i]->name, name) == 0) {
+	    return headers[i]->value;
+	}
     }
-    send_empty_http_response(status, statusExplain, toClient);
+    return NULL;
 }
 
-/* process_delete_request()
+/* matches_address()
  * −−−−−−−−−−−−−−−
- * Processes DELETE requests from the client and sends back the
- * HTTP response based on the operation
- * 
- * stats: the server statistics
- * store: database API
- * toClient: file descriptor writing to connected client
- * key: the value's key in the database
+ * Checks if a request address is the given path, optionally followed by a
+ * query string
+ *
+ * address: the request address URL
+ * path: the path
+ *
+ * Returns: 1 if the address is for the path, 0 otherwise
  */
-void process_delete_request(ServerStats* stats, struct StringStore* store, 
-	int toClient, char* key) {
-    int status;
-    char* statusExplain;
-
-    // Get status code and explanation based on if the operation succeeds
-    int err;
-    if ((err = stringstore_delete(store, key)) == 0) {
-	status = NOT_FOUND_STATUS;
-	statusExplain = NOT_FOUND_EXPLAIN;
-    } else {
-	status = OK_STATUS;
-	statusExplain = OK_EXPLAIN;
-	stats->deleteOps++; // successful DELETE request processed
-    }
-    send_empty_http_response(status, statusExplain, toClient);
+int matches_address(const char* address, const char* path) {
+    size_t length = strlen(path);
+    return strncmp(address, path, length) == 0 && 
+	    (address[length] == '\0' || address[length] == '?');
 }
 
-/* check_authorization()
+/* etag_matches()
  * −−−−−−−−−−−−−−−
- * Checks for authorization from the client
- * 
- * headers: the headers from HTTP request
- * authString: authorization string
+ * Determines if a key version matches an If-Match or If-None-Match header
+ * value, which is either "*" or a comma separated list of ETags
  * 
- * Returns: 1 if authorization is successful, 0 otherwise
+ * condition: the header value
+ * version: current version of the key, 0 if it does not exist
+ *
+ * Returns: 1 if the version matches, 0 otherwise
  */
-int check_authorization(HttpHeader** headers, char* authString) {
-    int authorized = 0; // Indicates if a valid authorization header is found
-    // Finds and checks if authorization header and string is valid
-    for (int i = 0; headers[i] != NULL; i++) {
-	if ((strcmp((headers[i])->name, "Authorization") == 0) && 
-		(strcmp(((headers[i])->value), authString) == 0)) {
-	    authorized = 1;
-	}   
+int etag_matches(const char* condition, uint64_t version) {
+    if (version == 0) {
+	return 0; // A missing key matches nothing, not even "*"
     }
-    return authorized; 
+    const char* tag = condition;
+    while (*tag != '\0') {
+	// Skip separators and the weak validator prefix
+	while (*tag == ' ' || *tag == ',') {
+	    tag++;
+	}
+	if (*tag == '*') {
+	    return 1;
+	}
+	if (strncmp(tag, "W/", 2) == 0) {
+	    tag += 2;
+	}
+	if (*tag == '"') {
+	    tag++;
+	}
+	char* end;
+	uint64_t tagVersion = strtoull(tag, &end, BASE_10);
+	if (end != tag && tagVersion == version) {
+	    return 1;
+	}
+	// Move on to the next ETag in the list
+	tag = strchr(end, ',');
+	if (tag == NULL) {
+	    break;
+	}
+    }
+    return 0;
 }
 
-/* check_valid_request()
+/* check_preconditions()
  * −−−−−−−−−−−−−−−
- * Checks if a HTTP request is well-formed and valid
- * 
- * method: the request type
- * parsedAddress: parsed address URL
+ * Checks the If-Match and If-None-Match headers of a request that modifies
+ * a key against its current version
  * 
- * Returns: 1 if HTTP request is valid, 0 otherwise
+ * headers: the HTTP request headers
+ * version: current version of the key, 0 if it does not exist
+ *
+ * Returns: 1 if the request may proceed, 0 if a precondition failed
  */
-int check_valid_request(char* method, char** parsedAddress, 
-	HttpHeader** headers, char* body) {
-    // Check if given request is a valid method
-    if ((strcmp(method, "GET")) && (strcmp(method, "PUT")) && 
-	    (strcmp(method, "DELETE"))) {
+int check_preconditions(HttpHeader** headers, uint64_t version) {
+    char* ifMatch = find_header(headers, "If-Match");
+    if (ifMatch != NULL && etag_matches(ifMatch, version) == 0) {
 	return 0;
     }
-
-    // Check for valid address
-    int i;
-    for (i = 0; parsedAddress[i] != NULL; i++) {	
-	// Checks if database type given is in the correct address URL format
-	if (i == 1) {
-	    if (strcmp(parsedAddress[i], "public") && 
-		    strcmp(parsedAddress[i], "private")) {
-		return 0;
-	    }   
-	}
-    }
-
-    // Checks if address URL length is valid
-    if (i > MAX_URL_LENGTH) {
+    char* ifNoneMatch = find_header(headers, "If-None-Match");
+    if (ifNoneMatch != NULL && etag_matches(ifNoneMatch, version)) {
 	return 0;
     }
     return 1;
 }
 
-/* process_method()
+/* has_preconditions()
  * −−−−−−−−−−−−−−−
- * Processes the HTTP request based on its request type
+ * Determines if a request is conditional on the version of its key
  * 
- * method: the request type
- * stats: the server statistics
- * store: database API
- * toClient: file descriptor writing to connected client
- * key: the value's key in the database
- * body: the HTTP request body
+ * headers: the HTTP request headers
+ *
+ * Returns: 1 if If-Match or If-None-Match is present, 0 otherwise
  */
-void process_method(char* method, ServerStats* stats, StringStore* store, 
-	int toClient, char* key, char* body) {
-    if (strcmp(method, "GET") == 0) {
-	process_get_request(stats, store, toClient, key);
-    } else if (strcmp(method, "PUT") == 0) {
-	process_put_request(stats, store, toClient, key, body);
-	
-    } else if (strcmp(method, "DELETE") == 0) {
-	process_delete_request(stats, store, toClient, key);
-    }
+int has_preconditions(HttpHeader** headers) {
+    return find_header(headers, "If-Match") != NULL || 
+	    find_header(headers, "If-None-Match") != NULL;
 }
 
-/* disconnect_client()
+/* hash_name()
  * −−−−−−−−−−−−−−−
- * Closes any open file descriptors and streams. Frees the headers.
- * 
- * headers: the HTTP response header
- * store: database API
- * toClient: file descriptor writing to client
- * fromClient: file stream reading from client
- * clientReadEnd: file descriptor reading to client
+ * Hashes a database name into a bucket index (djb2)
+ *
+ * name: the database name
+ *
+ * Returns: the bucket index
  */
-void disconnect_client(HttpHeader** headers, ServerStats* stats, int toClient, 
-	FILE* fromClient, int clientReadEnd) {
-    free_array_of_headers(headers);
-    // Closes all file descriptors and streams
-    fclose(fromClient);
-    close(toClient);
-    close(clientReadEnd);
-    // Indicate that client is completed and has finished connecting
-    stats->completed++;
-    stats->connected--;
+unsigned int hash_name(const char* name) {
+    unsigned long hash = 5381;
+    for (int i = 0; name[i] != '\0'; i++) {
+	hash = hash * 33 + (unsigned char)name[i];
+    }
+    return hash % DATABASE_BUCKETS;
 }
 
-/* handle_client()
+/* database_map_init()
  * −−−−−−−−−−−−−−−
- * Processes and handles HTTP requests from the client. Sends HTTP responses
- * based on the operation.
+ * Initialises an empty database map
  *
- * arg: arguments passed to thread
+ * Returns: the initialised database map
  */
-void* handle_client(void* arg) {
-    // Extract arguments passed into thread function
-    ThreadParameters arguments = *(ThreadParameters*)arg;
-    char* authString = arguments.authString;
-    ServerStats* stats = arguments.stats;
-    pthread_mutex_t lock = arguments.lock;
-    // Set up file descriptors, streams, and variables to be used
-    int toClient = arguments.client;
-    int clientReadEnd = dup(toClient);
-    FILE* fromClient = fdopen(clientReadEnd, "r");
-    char* method, *address, *body;
-    HttpHeader** headers;
-    int err;
-    int failedAuthorization = 0; // Determines if an authorization has failed
-    struct StringStore* store; 
-    // Repeatedly read requests from client until EOF
-    while ((err = get_HTTP_request(fromClient, &method, &address, 
-	    &headers, &body) == 1)) {
-	// Check if given request is well-formed AND valid
-	char** parsedAddress = split_by_char(address, '/', MAX_URL_LENGTH); 
-	if (check_valid_request(method, parsedAddress, headers, body)) {
-	    pthread_mutex_lock(&lock);
-	    // Checks if request is private with valid authorization
-	    char* databaseType = parsedAddress[1];
-	    if (strcmp(databaseType, "private") == 0) {
-		if (check_authorization(headers, authString) == 0) {
-		    failedAuthorization = 1;
-		    stats->authFails++;
-		    send_empty_http_response(UNAUTHORIZED_STATUS, 
-			    UNAUTHORIZED_EXPLAIN, toClient);
-		}
-		store = arguments.private; // Database set to private instance
-	    } else {
-		store = arguments.public; // Database set to public instance
-	    } 
-	    // Process requests into their respective functions
-	    if (failedAuthorization == 0) {
-		char* key = parsedAddress[KEY_ARG]; // Extract key from address
-		process_method(method, stats, store, toClient, key, body);
-	    }
-	    failedAuthorization = 0;
-	    pthread_mutex_unlock(&lock);
-	} else {
-	    // Sends ahttp request if request is not well-formed
-	    send_empty_http_response(BAD_STATUS, BAD_EXPLAIN, toClient);
-    	}
+DatabaseMap* database_map_init(void) {
+    DatabaseMap* map = malloc(sizeof(DatabaseMap));
+    pthread_rwlock_init(&map->lock, NULL);
+    for (int i = 0; i < DATABASE_BUCKETS; i++) {
+	map->buckets[i] = NULL;
     }
-    free(arg);
-    disconnect_client(headers, stats, toClient, fromClient, clientReadEnd);
-    return NULL;
+    map->count = 0;
+    map->log = NULL;
+    map->readOnly = 0;
+    map->staging = 0;
+    pthread_mutex_init(&map->cachesLock, NULL);
+    map->caches = NULL;
+    return map;
 }
 
-/* print_stats()
+/* find_database()
  * −−−−−−−−−−−−−−−
- * Prints the server statistics
+ * Finds a database in the map. The map lock must be held by the caller.
  *
- * stats: the server statistics
+ * map: the database map
+ * name: the database name
+ *
+ * Returns: the database, NULL if it does not exist
  */
-void print_stats(ServerStats* stats) {
-    fprintf(stderr, "Connected clients:%d\n"
-	    "Completed clients:%d\n"
-	    "Auth failures:%d\n"
-	    "GET operations:%d\n"
-	    "PUT operations:%d\n"
-	    "DELETE operations:%d\n", stats->connected, stats->completed, 
-	    stats->authFails, stats->getOps, stats->putOps, stats->deleteOps);
-    fflush(stderr);
+Database* find_database(DatabaseMap* map, const char* name) {
+    Database* database = map->buckets[hash_name(name)];
+    while (database != NULL && strcmp(database->name, name) != 0) {
+	database = database->next;
+    }
+    return database;
 }
 
-/* handle_sig()
+/* get_database()
  * −−−−−−−−−−−−−−−
- * Handles signals. Prints the server statistics based on the signal received.
+ * Looks up a database by name, optionally creating it if it does not exist.
+ * Databases created this way need no authorization.
  *
- * args: arguments passed to thread
+ * map: the database map
+ * name: the database name
+ * create: 1 if a missing database should be created, 0 otherwise
+ *
+ * Returns: the database, NULL if it does not exist and could not be created
  */
-void* handle_sig(void* args) {
-    SigParameters arguments = *(SigParameters*)args;
-    sigset_t set = arguments.set;
-    ServerStats* stats = arguments.stats;
-    free(args);
-    int sig;
+Database* get_database(DatabaseMap* map, const char* name, int create) {
+    pthread_rwlock_rdlock(&map->lock);
+    Database* database = find_database(map, name);
+    pthread_rwlock_unlock(&map->lock);
+    if (database != NULL || create == 0) {
+	return database;
+    }
 
-    // Repeatedly wait until SIGHUP is detected
-    while (1) {
-    	sigwait(&set, &sig);
-	if (sig == SIGHUP) {
-	    print_stats(stats);
-	}
+    pthread_rwlock_wrlock(&map->lock);
+    // Another thread may have created it while the lock was released
+    database = find_database(map, name);
+    if (database == NULL && map->count < MAX_DATABASES) {
+	database = malloc(sizeof(Database));
+	database->name = strdup(name);
+	database->authString = NULL;
+	database->store = stringstore_init();
+	database->staged = NULL;
+	pthread_mutex_init(&database->lock, NULL);
+	database->authFails = 0;
+	database->getOps = 0;
+	database->putOps = 0;
+	database->deleteOps = 0;
+	database->postOps = 0;
+	database->log = map->log;
+	database->id = map->count;
+	memset(&database->sketch, 0, sizeof(CountMinSketch));
+	memset(database->epochs, 0, sizeof(database->epochs));
+	map->byId[map->count] = database;
+	// Insert at the head of the bucket
+	unsigned int bucket = hash_name(name);
+	database->next = map->buckets[bucket];
+	map->buckets[bucket] = database;
+	map->count++;
     }
+    pthread_rwlock_unlock(&map->lock);
+    return database;
 }
 
-/* process_connections()
+/* declare_database()
  * −−−−−−−−−−−−−−−
- * Processes connections and creates threads to handle them 	
+ * Creates a database if needed and sets the authorization it requires
  *
- * serverSocket: the file descriptor socket for communication to server
- * stats: the server statistics
- * publicStore: database API for public instance
- * privateStoreL database API for private instance
- * serverDetails: command line arguments when creating dbserver 
+ * map: the database map
+ * name: the database name
+ * authString: authorization string, NULL if none is required
+ *
+ * Returns: 1 if the database was declared, 0 if there are too many databases
  */
-void process_connections(int serverSocket, ServerStats* stats, 
-	struct StringStore* publicStore, struct StringStore* privateStore, 
-	ServerParameters serverDetails) {
-    // Set up locks
-    pthread_mutex_t lock;
-    pthread_mutex_init(&lock, NULL);
-    struct sockaddr_in fromAddr;
-    socklen_t fromAddrSize; 
-    pthread_t thread;
-    // Set up sigset and sigmask to handle specific signals
-    sigset_t set;
-    sigemptyset(&set);
-    sigaddset(&set, SIGHUP);
-    sigaddset(&set, SIGPIPE);
+int declare_database(DatabaseMap* map, const char* name, char* authString) {
+    Database* database = get_database(map, name, 1);
+    if (database == NULL) {
+	return 0;
+    }
+    database->authString = authString;
+    return 1;
+}
+
+/* load_database_file()
+ * −−−−−−−−−−−−−−−
+ * Declares the databases listed in a database file. Each line holds a 
+ * database name, optionally followed by a space and its authorization 
+ * string. Empty lines and lines starting with '#' are ignored.
+ *
+ * map: the database map
+ * path: path to the database file
+ *
+ * Returns: Exit code 4 if the database file is invalid
+ */
+void load_database_file(DatabaseMap* map, char* path) {
+    FILE* databaseFile = fopen(path, "r");
+    if (databaseFile == NULL) {
+	fprintf(stderr, "dbserver: unable to read database file\n");
+	exit(EXIT_DATABASES_ERROR);
+    }
+    char* line;
+    while ((line = read_line(databaseFile)) != NULL) {
+	if (line[0] == '\0' || line[0] == '#') {
+	    free(line);
+	    continue;
+	}
+	// Split the name from the rest of the line (the authorization string)
+	char* authString = NULL;
+	char* space = strchr(line, ' ');
+	if (space != NULL) {
+	    *space = '\0';
+	    authString = strdup(space + 1);
+	}
+	if (strchr(line, '/') != NULL || 
+		declare_database(map, line, authString) == 0) {
+	    fprintf(stderr, "dbserver: invalid database \"%s\"\n", line);
+	    exit(EXIT_DATABASES_ERROR);
+	}
+	free(line);
+    }
+    fclose(databaseFile);
+}
+
+/* replication_log_init()
+ * −−−−−−−−−−−−−−−
+ * Initialises an empty replication log
+ *
+ * Returns: the initialised replication log
+ */
+ReplicationLog* replication_log_init(void) {
+    ReplicationLog* log = malloc(sizeof(ReplicationLog));
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->changed, NULL);
+    log->nextSeq = 1;
+    log->count = 0;
+    log->bytes = 0;
+    log->closed = 0;
+    // Offsets into the log of a previous run must not be trusted
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    sprintf(log->id, "%" PRIu64, ((uint64_t)now.tv_sec << 32) ^ 
+	    (uint64_t)now.tv_nsec ^ getpid());
+    return log;
+}
+
+/* attach_replication_log()
+ * −−−−−−−−−−−−−−−
+ * Makes every database, existing or created later, record its changes in
+ * the given replication log
+ *
+ * map: the database map
+ * log: the replication log
+ */
+void attach_replication_log(DatabaseMap* map, ReplicationLog* log) {
+    pthread_rwlock_wrlock(&map->lock);
+    map->log = log;
+    for (int i = 0; i < map->count; i++) {
+	pthread_mutex_lock(&map->byId[i]->lock);
+	map->byId[i]->log = log;
+	pthread_mutex_unlock(&map->byId[i]->lock);
+    }
+    pthread_rwlock_unlock(&map->lock);
+}
+
+/* close_replication_log()
+ * −−−−−−−−−−−−−−−
+ * Marks the replication log as closed, so replicas streaming it disconnect
+ * once they have every change
+ *
+ * log: the replication log
+ */
+void close_replication_log(ReplicationLog* log) {
+    pthread_mutex_lock(&log->lock);
+    log->closed = 1;
+    pthread_cond_broadcast(&log->changed);
+    pthread_mutex_unlock(&log->lock);
+}
+
+/* hash_key()
+ * −−−−−−−−−−−−−−−
+ * Hashes a key (FNV-1a)
+ *
+ * key: the key
+ *
+ * Returns: the 64 bit hash
+ */
+uint64_t hash_key(const char* key) {
+    uint64_t hash = FNV_OFFSET;
+    for (int i = 0; key[i] != '\0'; i++) {
+	hash = (hash ^ (unsigned char)key[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/* key_stripe()
+ * −−−−−−−−−−−−−−−
+ * Returns: the epoch stripe a key belongs to
+ */
+unsigned int key_stripe(const char* key) {
+    return hash_key(key) % EPOCH_STRIPES;
+}
+
+/* append_record()
+ * −−−−−−−−−−−−−−−
+ * Appends a record to a replication log, first dropping the oldest records
+ * while the log is full. The log takes ownership of the key and value.
+ *
+ * log: the replication log
+ * type: the record type
+ * version: the new version of the key, 0 if none
+ * database: the database name
+ * key: the key, NULL if none
+ * value: the value, NULL if none
+ * valueLength: length of the value
+ */
+void append_record(ReplicationLog* log, int type, uint64_t version, 
+	char* database, char* key, char* value, size_t valueLength) {
+    size_t size = (key == NULL ? 0 : strlen(key)) + valueLength;
+    pthread_mutex_lock(&log->lock);
+    while (log->count > 0 && (log->count == REPLICATION_LOG_SIZE || 
+	    log->bytes + size > REPLICATION_LOG_BYTES)) {
+	ChangeRecord* oldest = &log->records[(log->nextSeq - log->count) % 
+		REPLICATION_LOG_SIZE];
+	free(oldest->key);
+	free(oldest->value);
+	log->bytes -= oldest->size;
+	log->count--;
+    }
+    ChangeRecord* record = &log->records[log->nextSeq % REPLICATION_LOG_SIZE];
+    record->seq = log->nextSeq++;
+    record->version = version;
+    record->type = type;
+    record->database = database;
+    record->key = key;
+    record->value = value;
+    record->valueLength = valueLength;
+    record->size = size;
+    log->bytes += size;
+    log->count++;
+    pthread_cond_broadcast(&log->changed);
+    pthread_mutex_unlock(&log->lock);
+}
+
+/* record_change()
+ * −−−−−−−−−−−−−−−
+ * Marks cached copies of a changed key as stale, then appends the change
+ * to the replication log of the database, if it has one. Must be called 
+ * while holding the database lock so the log order matches the order 
+ * changes were made in.
+ *
+ * database: the database that changed
+ * type: CHANGE_PUT or CHANGE_DELETE
+ * key: the key that changed
+ * value: the new value of the key, NULL for CHANGE_DELETE
+ * version: the new version of the key, 0 for CHANGE_DELETE
+ */
+void record_change(Database* database, int type, const char* key, 
+	const char* value, uint64_t version) {
+    __atomic_add_fetch(&database->epochs[key_stripe(key)], 1, 
+	    __ATOMIC_RELEASE);
+    if (database->log == NULL) {
+	return;
+    }
+    append_record(database->log, type, version, database->name, strdup(key),
+	    value == NULL ? NULL : strdup(value), 
+	    value == NULL ? 0 : strlen(value));
+}
+
+/* send_value_http_response()
+ * −−−−−−−−−−−−−−−
+ * Sends a 200 HTTP response with a value as the body and its version as 
+ * the ETag
+ * 
+ * value: the value to send
+ * version: version of the key the value is stored at
+ * toClient: file descriptor writing to connected client
+ */
+void send_value_http_response(const char* value, uint64_t version, 
+	int toClient) {
+    trace_mark(TRACE_RESPONDING);
+    char etag[ETAG_LENGTH];
+    sprintf(etag, "\"%" PRIu64 "\"", version);
+    HttpHeader** headers = construct_etag_headers(etag);
+
+    // Get content length by converting int to string
+    int valueLength = strlen(value);
+    char contentLength[sizeof(int) * 3 + 1];
+    sprintf(contentLength, "%d", valueLength);
+
+    headers[0]->value = contentLength;
+    char* response = construct_HTTP_response(OK_STATUS, OK_EXPLAIN, 
+	    headers, value);
+    write(toClient, response, strlen(response));
+    trace_mark(TRACE_RESPONDED);
+    free(response);
+    free_response_headers(headers);
+}
+
+/* send_body_http_response()
+ * −−−−−−−−−−−−−−−
+ * Sends a 200 (OK) HTTP response with the given body
+ *
+ * body: the response body
+ * toClient: file descriptor writing to connected client
+ */
+void send_body_http_response(const char* body, int toClient) {
+    trace_mark(TRACE_RESPONDING);
+    HttpHeader** headers = construct_empty_headers();
+    char contentLength[INT64_LENGTH];
+    sprintf(contentLength, "%zu", strlen(body));
+    headers[0]->value = contentLength;
+    char* response = construct_HTTP_response(OK_STATUS, OK_EXPLAIN, 
+	    headers, body);
+    write(toClient, response, strlen(response));
+    trace_mark(TRACE_RESPONDED);
+    free(response);
+    free_response_headers(headers);
+}
+
+/* send_get_response()
+ * −−−−−−−−−−−−−−−
+ * Sends the response to a successful GET request. The response carries the
+ * key's version as an ETag, and has no body if it matches If-None-Match.
+ * 
+ * value: the value of the key
+ * version: the version of the key
+ * requestHeaders: the HTTP request headers
+ * toClient: file descriptor writing to connected client
+ */
+void send_get_response(const char* value, uint64_t version, 
+	HttpHeader** requestHeaders, int toClient) {
+    char* ifNoneMatch = find_header(requestHeaders, "If-None-Match");
+    if (ifNoneMatch != NULL && etag_matches(ifNoneMatch, version)) {
+	// Client already has this version
+	send_etag_http_response(NOT_MODIFIED_STATUS, NOT_MODIFIED_EXPLAIN, 
+		version, toClient);
+    } else {
+	send_value_http_response(value, version, toClient);
+    }
+}
+
+/* cache_slot()
+ * −−−−−−−−−−−−−−−
+ * Returns: the thread cache entry a key of a database maps to
+ */
+CachedValue* cache_slot(ThreadCache* cache, Database* database, 
+	const char* key) {
+    return &cache->entries[(hash_key(key) + database->id * FNV_PRIME) % 
+	    THREAD_CACHE_SIZE];
+}
+
+/* acquire_thread_cache()
+ * −−−−−−−−−−−−−−−
+ * Gives a client handling thread a cache, reusing one left by a finished
+ * thread if possible
+ *
+ * databases: the database map
+ *
+ * Returns: the thread cache
+ */
+ThreadCache* acquire_thread_cache(DatabaseMap* databases) {
+    pthread_mutex_lock(&databases->cachesLock);
+    ThreadCache* cache = databases->caches;
+    while (cache != NULL && cache->inUse) {
+	cache = cache->next;
+    }
+    if (cache == NULL) {
+	cache = calloc(1, sizeof(ThreadCache));
+	cache->next = databases->caches;
+	databases->caches = cache;
+    }
+    cache->inUse = 1;
+    pthread_mutex_unlock(&databases->cachesLock);
+    return cache;
+}
+
+/* release_thread_cache()
+ * −−−−−−−−−−−−−−−
+ * Returns the cache of a finishing thread for reuse, keeping its entries
+ *
+ * databases: the database map
+ * cache: the thread cache
+ */
+void release_thread_cache(DatabaseMap* databases, ThreadCache* cache) {
+    pthread_mutex_lock(&databases->cachesLock);
+    cache->inUse = 0;
+    pthread_mutex_unlock(&databases->cachesLock);
+}
+
+/* count_cache_hits()
+ * −−−−−−−−−−−−−−−
+ * Totals the GETs every thread cache has served for each database
+ *
+ * databases: the database map
+ * hits: set to the GETs served by database id, MAX_DATABASES long
+ */
+void count_cache_hits(DatabaseMap* databases, unsigned int* hits) {
+    memset(hits, 0, sizeof(unsigned int) * MAX_DATABASES);
+    pthread_mutex_lock(&databases->cachesLock);
+    for (ThreadCache* cache = databases->caches; cache != NULL; 
+	    cache = cache->next) {
+	for (int i = 0; i < MAX_DATABASES; i++) {
+	    hits[i] += __atomic_load_n(&cache->hits[i], __ATOMIC_RELAXED);
+	}
+    }
+    pthread_mutex_unlock(&databases->cachesLock);
+}
+
+/* clear_cached_value()
+ * −−−−−−−−−−−−−−−
+ * Empties a thread cache entry
+ *
+ * entry: the thread cache entry
+ */
+void clear_cached_value(CachedValue* entry) {
+    if (entry->database != NULL) {
+	free(entry->key);
+	free(entry->value);
+	entry->database = NULL;
+    }
+}
+
+/* serve_cached_get()
+ * −−−−−−−−−−−−−−−
+ * Serves a GET request from the thread's cache without taking the database
+ * lock, if the key is cached and no change has been made to its epoch 
+ * stripe since.
+ * 
+ * cache: the thread cache
+ * database: the database to query
+ * key: the value's key in the database
+ * requestHeaders: the HTTP request headers
+ * toClient: file descriptor writing to connected client
+ *
+ * Returns: 1 if the request was served, 0 if it must go to the database
+ */
+int serve_cached_get(ThreadCache* cache, Database* database, char* key, 
+	HttpHeader** requestHeaders, int toClient) {
+    CachedValue* entry = cache_slot(cache, database, key);
+    if (entry->database != database || strcmp(entry->key, key) != 0 || 
+	    __atomic_load_n(&database->epochs[entry->stripe], 
+	    __ATOMIC_ACQUIRE) != entry->epoch) {
+	return 0;
+    }
+    // Atomic as the statistics may be read at any time
+    __atomic_store_n(&cache->hits[database->id], 
+	    cache->hits[database->id] + 1, __ATOMIC_RELAXED);
+    send_get_response(entry->value, entry->version, requestHeaders, 
+	    toClient);
+    return 1;
+}
+
+/* is_hot_key()
+ * −−−−−−−−−−−−−−−
+ * Samples a GET request into the database's count-min sketch and estimates
+ * whether the key is hot. Must be called while holding the database lock.
+ * Requests are counted in the sketch, so sampling spans every thread.
+ * 
+ * database: the database being queried
+ * key: the key being read
+ *
+ * Returns: 1 if the key is read often enough to be cached, 0 otherwise
+ */
+int is_hot_key(Database* database, const char* key) {
+    CountMinSketch* sketch = &database->sketch;
+    uint64_t hash = hash_key(key);
+    // Derive a hash for each row from two halves of the key hash
+    uint32_t hashA = (uint32_t)hash;
+    uint32_t hashB = (uint32_t)(hash >> 32) | 1;
+    int sampled = ++sketch->requests % SKETCH_SAMPLE_RATE == 0;
+    uint32_t estimate = UINT32_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+	uint32_t* count = &sketch->counts[row][(hashA + row * hashB) % 
+		SKETCH_WIDTH];
+	if (sampled) {
+	    (*count)++;
+	}
+	if (*count < estimate) {
+	    estimate = *count;
+	}
+    }
+    if (sampled && ++sketch->samples >= SKETCH_DECAY_INTERVAL) {
+	for (int row = 0; row < SKETCH_DEPTH; row++) {
+	    for (int column = 0; column < SKETCH_WIDTH; column++) {
+		sketch->counts[row][column] /= 2;
+	    }
+	}
+	sketch->samples = 0;
+    }
+    return estimate >= HOT_KEY_THRESHOLD;
+}
+
+/* cache_value()
+ * −−−−−−−−−−−−−−−
+ * Copies the value of a hot key into the thread cache. Must be called 
+ * while holding the database lock so the value and epoch agree.
+ * 
+ * cache: the thread cache
+ * database: the database the key is in
+ * key: the key
+ * value: the value of the key
+ * version: the version of the key
+ */
+void cache_value(ThreadCache* cache, Database* database, const char* key, 
+	const char* value, uint64_t version) {
+    CachedValue* entry = cache_slot(cache, database, key);
+    clear_cached_value(entry);
+    entry->database = database;
+    entry->key = strdup(key);
+    entry->value = strdup(value);
+    entry->version = version;
+    entry->stripe = key_stripe(key);
+    entry->epoch = __atomic_load_n(&database->epochs[entry->stripe], 
+	    __ATOMIC_ACQUIRE);
+}
+
+/* process_get_request()
+ * −−−−−−−−−−−−−−−
+ * Processes GET requests from the client and sends back the 
+ * HTTP response based on the operation. Hot keys are copied into the
+ * thread cache so later GETs for them can skip the database lock.
+ * 
+ * database: the database to query
+ * cache: the thread cache
+ * toClient: file descriptor writing to connected client
+ * key: the value's key in the database
+ * requestHeaders: the HTTP request headers
+ */
+void process_get_request(Database* database, ThreadCache* cache, 
+	int toClient, char* key, HttpHeader** requestHeaders) {
+    uint64_t version;
+    const char* value = stringstore_retrieve_versioned(database->store, key, 
+	    &version);
+
+    // Send HTTP response based on value retrieved
+    if (value == NULL) {
+	send_empty_http_response(NOT_FOUND_STATUS, NOT_FOUND_EXPLAIN, 
+		toClient);
+	return;
+    }
+    database->getOps++; // successful GET request processed
+    if (is_hot_key(database, key)) {
+	cache_value(cache, database, key, value, version);
+    }
+    send_get_response(value, version, requestHeaders, toClient);
+}
+
+/* process_put_request()
+ * −−−−−−−−−−−−−−−
+ * Processes PUT requests from the client and sends back the
+ * HTTP response based on the operation. The value is only stored if the
+ * key's version satisfies any If-Match or If-None-Match header.
+ * 
+ * database: the database to update
+ * toClient: file descriptor writing to connected client
+ * key: the value's key in the database
+ * valueToUpdate: the key's value in the database
+ * requestHeaders: the HTTP request headers
+ */
+void process_put_request(Database* database, int toClient, char* key, 
+	char* valueToUpdate, HttpHeader** requestHeaders) {
+    uint64_t version = 0;
+    
+    // Compare-and-swap: the database lock is held from check to update
+    if (has_preconditions(requestHeaders)) {
+	stringstore_retrieve_versioned(database->store, key, &version);
+	if (check_preconditions(requestHeaders, version) == 0) {
+	    send_empty_http_response(PRECONDITION_FAILED_STATUS, 
+		    PRECONDITION_FAILED_EXPLAIN, toClient);
+	    return;
+	}
+    }
+    // Get status code and explanation based on if the operation succeeds
+    version = stringstore_add_versioned(database->store, key, valueToUpdate);
+    if (version == 0) {
+	send_empty_http_response(INTERNAL_ERROR_STATUS, 
+		INTERNAL_ERROR_EXPLAIN, toClient);
+    } else {
+	database->putOps++; // successful PUT request processed
+	record_change(database, CHANGE_PUT, key, valueToUpdate, version);
+	send_etag_http_response(OK_STATUS, OK_EXPLAIN, version, toClient);
+    }
+}
+
+/* process_delete_request()
+ * −−−−−−−−−−−−−−−
+ * Processes DELETE requests from the client and sends back the
+ * HTTP response based on the operation. The key is only deleted if its
+ * version satisfies any If-Match or If-None-Match header.
+ * 
+ * database: the database to update
+ * toClient: file descriptor writing to connected client
+ * key: the value's key in the database
+ * requestHeaders: the HTTP request headers
+ */
+void process_delete_request(Database* database, int toClient, char* key, 
+	HttpHeader** requestHeaders) {
+    int status;
+    char* statusExplain;
+    uint64_t version = 0;
+
+    if (has_preconditions(requestHeaders)) {
+	stringstore_retrieve_versioned(database->store, key, &version);
+	if (check_preconditions(requestHeaders, version) == 0) {
+	    send_empty_http_response(PRECONDITION_FAILED_STATUS, 
+		    PRECONDITION_FAILED_EXPLAIN, toClient);
+	    return;
+	}
+    }
+    // Get status code and explanation based on if the operation succeeds
+    int err;
+    if ((err = stringstore_delete(database->store, key)) == 0) {
+	status = NOT_FOUND_STATUS;
+	statusExplain = NOT_FOUND_EXPLAIN;
+    } else {
+	status = OK_STATUS;
+	statusExplain = OK_EXPLAIN;
+	database->deleteOps++; // successful DELETE request processed
+	record_change(database, CHANGE_DELETE, key, NULL, 0);
+    }
+    send_empty_http_response(status, statusExplain, toClient);
+}
+
+/* parse_operation()
+ * −−−−−−−−−−−−−−−
+ * Splits the query string ("?op=name&by=amount") off a POST request key
+ * and extracts its parameters. Unknown parameters are ignored.
+ * 
+ * key: the key from the request address, truncated at the query string
+ * op: set to the operation name, NULL if not given
+ * by: set to the increment amount, NULL if not given
+ */
+void parse_operation(char* key, char** op, char** by) {
+    *op = NULL;
+    *by = NULL;
+    char* query = strchr(key, '?');
+    if (query == NULL) {
+	return;
+    }
+    *query++ = '\0';
+    char* parameter = strtok_r(query, "&", &query);
+    while (parameter != NULL) {
+	if (strncmp(parameter, "op=", strlen("op=")) == 0) {
+	    *op = parameter + strlen("op=");
+	} else if (strncmp(parameter, "by=", strlen("by=")) == 0) {
+	    *by = parameter + strlen("by=");
+	}
+	parameter = strtok_r(NULL, "&", &query);
+    }
+}
+
+/* process_post_request()
+ * −−−−−−−−−−−−−−−
+ * Processes POST requests, which atomically update a key in place under the
+ * database lock, and sends back the HTTP response based on the operation.
+ * "op=incr&by=N" adds N (default 1) to an integer value and responds with
+ * the sum. "op=append" appends the request body to the value.
+ * 
+ * database: the database to update
+ * toClient: file descriptor writing to connected client
+ * key: the value's key in the database, followed by the query string
+ * body: the HTTP request body
+ * requestHeaders: the HTTP request headers
+ */
+void process_post_request(Database* database, int toClient, char* key, 
+	char* body, HttpHeader** requestHeaders) {
+    char* op, *by;
+    uint64_t version = 0;
+    parse_operation(key, &op, &by);
+    if (op == NULL || key[0] == '\0' || (strcmp(op, INCREMENT_OP) && 
+	    strcmp(op, APPEND_OP))) {
+	send_empty_http_response(BAD_STATUS, BAD_EXPLAIN, toClient);
+	return;
+    }
+    if (has_preconditions(requestHeaders)) {
+	stringstore_retrieve_versioned(database->store, key, &version);
+	if (check_preconditions(requestHeaders, version) == 0) {
+	    send_empty_http_response(PRECONDITION_FAILED_STATUS, 
+		    PRECONDITION_FAILED_EXPLAIN, toClient);
+	    return;
+	}
+    }
+
+    if (strcmp(op, INCREMENT_OP) == 0) {
+	// The amount must be a whole decimal integer
+	int64_t amount = 1;
+	if (by != NULL) {
+	    char* end;
+	    errno = 0;
+	    amount = strtoll(by, &end, BASE_10);
+	    if (by[0] == '\0' || *end != '\0' || errno == ERANGE) {
+		send_empty_http_response(BAD_STATUS, BAD_EXPLAIN, toClient);
+		return;
+	    }
+	}
+	int64_t result;
+	version = stringstore_increment(database->store, key, amount, 
+		&result);
+	if (version == 0) {
+	    // Stored value is not an integer, or the sum overflows
+	    send_empty_http_response(CONFLICT_STATUS, CONFLICT_EXPLAIN, 
+		    toClient);
+	    return;
+	}
+	char sum[INT64_LENGTH];
+	sprintf(sum, "%" PRId64, result);
+	record_change(database, CHANGE_PUT, key, sum, version);
+	send_value_http_response(sum, version, toClient);
+    } else {
+	version = stringstore_append(database->store, key, body);
+	if (version == 0) {
+	    send_empty_http_response(INTERNAL_ERROR_STATUS, 
+		    INTERNAL_ERROR_EXPLAIN, toClient);
+	    return;
+	}
+	// Replicas are sent the whole value so replaying it is idempotent
+	record_change(database, CHANGE_PUT, key, 
+		stringstore_retrieve(database->store, key), version);
+	send_etag_http_response(OK_STATUS, OK_EXPLAIN, version, toClient);
+    }
+    database->postOps++; // successful POST request processed
+}
+
+/* check_authorization()
+ * −−−−−−−−−−−−−−−
+ * Checks for authorization from the client
+ * 
+ * headers: the headers from HTTP request
+ * authString: authorization string
+ * 
+ * Returns: 1 if authorization is successful, 0 otherwise
+ */
+int check_authorization(HttpHeader** headers, char* authString) {
+    int authorized = 0; // Indicates if a valid authorization header is found
+    // Finds and checks if authorization header and string is valid
+    for (int i = 0; headers[i] != NULL; i++) {
+	if ((strcmp((headers[i])->name, "Authorization") == 0) && 
+		(strcmp(((headers[i])->value), authString) == 0)) {
+	    authorized = 1;
+	}   
+    }
+    return authorized; 
+}
+
+/* check_valid_request()
+ * −−−−−−−−−−−−−−−
+ * Checks if a HTTP request is well-formed and valid
+ * 
+ * method: the request type
+ * parsedAddress: parsed address URL
+ * 
+ * Returns: 1 if HTTP request is valid, 0 otherwise
+ */
+int check_valid_request(char* method, char** parsedAddress, 
+	HttpHeader** headers, char* body) {
+    // Check if given request is a valid method
+    if ((strcmp(method, "GET")) && (strcmp(method, "PUT")) && 
+	    (strcmp(method, "DELETE")) && (strcmp(method, "POST"))) {
+	return 0;
+    }
+
+    // Check for valid address
+    int i;
+    for (i = 0; parsedAddress[i] != NULL; i++) {	
+	// Checks if a database name is given
+	if (i == DATABASE_ARG && parsedAddress[i][0] == '\0') {
+	    return 0;
+	}
+    }
+
+    // Checks if address URL length is valid
+    if (i != MAX_URL_LENGTH) {
+	return 0;
+    }
+    return 1;
+}
+
+/* process_method()
+ * −−−−−−−−−−−−−−−
+ * Processes the HTTP request based on its request type
+ * 
+ * method: the request type
+ * database: the database the request is for
+ * cache: the thread cache
+ * toClient: file descriptor writing to connected client
+ * key: the value's key in the database
+ * headers: the HTTP request headers
+ * body: the HTTP request body
+ */
+void process_method(char* method, Database* database, ThreadCache* cache,
+	int toClient, char* key, HttpHeader** headers, char* body) {
+    if (strcmp(method, "GET") == 0) {
+	process_get_request(database, cache, toClient, key, headers);
+    } else if (strcmp(method, "PUT") == 0) {
+	process_put_request(database, toClient, key, body, headers);
+	
+    } else if (strcmp(method, "DELETE") == 0) {
+	process_delete_request(database, toClient, key, headers);
+    } else if (strcmp(method, "POST") == 0) {
+	process_post_request(database, toClient, key, body, headers);
+    }
+}
+
+/* elapsed_ms()
+ * −−−−−−−−−−−−−−−
+ * Computes the milliseconds elapsed since the given monotonic time
+ *
+ * since: the starting time
+ *
+ * Returns: milliseconds elapsed
+ */
+long elapsed_ms(struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * MS_PER_SEC + 
+	    (now.tv_nsec - since->tv_nsec) / NS_PER_MS;
+}
+
+/* set_client_timeouts()
+ * −−−−−−−−−−−−−−−
+ * Sets read and write timeouts on a client socket so that idle or stalled
+ * clients release their connection slot
+ *
+ * client: the client socket
+ */
+void set_client_timeouts(int client) {
+    struct timeval timeout;
+    timeout.tv_sec = CLIENT_TIMEOUT_SECS;
+    timeout.tv_usec = 0;
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+/* reject_client()
+ * −−−−−−−−−−−−−−−
+ * Sends a 503 response to a client without blocking then closes it. If the 
+ * client is not reading, the response is dropped rather than stalling the
+ * calling thread.
+ *
+ * admission: the admission control state
+ * stats: the server statistics
+ * client: the client socket
+ * binary: 1 if the client uses the binary protocol, 0 for HTTP
+ */
+void reject_client(Admission* admission, ServerStats* stats, int client, 
+	int binary) {
+    int flags = fcntl(client, F_GETFL);
+    fcntl(client, F_SETFL, flags | O_NONBLOCK);
+    if (binary) {
+	send(client, admission->binaryRejectResponse, BINARY_RESPONSE_BYTES, 
+		MSG_NOSIGNAL);
+    } else {
+	send(client, admission->rejectResponse, 
+		strlen(admission->rejectResponse), MSG_NOSIGNAL);
+    }
+    close(client);
+    pthread_mutex_lock(&stats->lock);
+    stats->rejected++;
+    pthread_mutex_unlock(&stats->lock);
+}
+
+/* admission_init()
+ * −−−−−−−−−−−−−−−
+ * Initialises the admission control state
+ *
+ * limit: maximum amount of concurrent connections, 0 for unlimited
+ *
+ * Returns: the initialised admission control state
+ */
+Admission* admission_init(int limit) {
+    Admission* admission = malloc(sizeof(Admission));
+    pthread_mutex_init(&admission->lock, NULL);
+    pthread_cond_init(&admission->idle, NULL);
+    admission->limit = limit;
+    admission->active = 0;
+    admission->draining = 0;
+    admission->clients = NULL;
+    admission->clientCount = 0;
+    admission->clientCapacity = 0;
+    admission->head = 0;
+    admission->count = 0;
+    // Rejection response is built once so rejecting needs no allocation
+    HttpHeader** headers = construct_empty_headers();
+    admission->rejectResponse = construct_HTTP_response(UNAVAILABLE_STATUS, 
+	    UNAVAILABLE_EXPLAIN, headers, NULL);
+    free_response_headers(headers);
+    // Binary response: status, reserved field and value length of 0
+    uint16_t status = htons(UNAVAILABLE_STATUS);
+    memset(admission->binaryRejectResponse, 0, BINARY_RESPONSE_BYTES);
+    memcpy(admission->binaryRejectResponse, &status, sizeof(status));
+    return admission;
+}
+
+/* admit_client()
+ * −−−−−−−−−−−−−−−
+ * Decides whether a newly accepted client runs immediately, waits for a
+ * connection slot or is rejected
+ *
+ * admission: the admission control state
+ * stats: the server statistics
+ * client: the client socket
+ * binary: 1 if the client uses the binary protocol, 0 for HTTP
+ *
+ * Returns: ADMIT_RUN if a slot was taken for the client,
+ *          ADMIT_QUEUED if the client is waiting for a slot,
+ *          ADMIT_REJECT if the client must be rejected
+ */
+AdmitResult admit_client(Admission* admission, ServerStats* stats, 
+	int client, int binary) {
+    AdmitResult result;
+    pthread_mutex_lock(&admission->lock);
+    if (admission->limit == 0 || admission->active < admission->limit) {
+	admission->active++;
+	pthread_mutex_lock(&stats->lock);
+	stats->connected++;
+	pthread_mutex_unlock(&stats->lock);
+	result = ADMIT_RUN;
+    } else if (admission->count < MAX_PENDING_CLIENTS) {
+	// Append to the tail of the ring buffer
+	PendingClient* pending = &admission->pending[(admission->head + 
+		admission->count) % MAX_PENDING_CLIENTS];
+	pending->client = client;
+	pending->binary = binary;
+	clock_gettime(CLOCK_MONOTONIC, &pending->queuedAt);
+	admission->count++;
+	pthread_mutex_lock(&stats->lock);
+	stats->queued++;
+	pthread_mutex_unlock(&stats->lock);
+	result = ADMIT_QUEUED;
+    } else {
+	result = ADMIT_REJECT;
+    }
+    pthread_mutex_unlock(&admission->lock);
+    return result;
+}
+
+/* next_pending_client()
+ * −−−−−−−−−−−−−−−
+ * Hands the connection slot of a finished client to the oldest pending
+ * client. Pending clients which waited longer than the timeout, or which 
+ * are still waiting once the server drains, are rejected. Releases the 
+ * slot if there are no pending clients.
+ *
+ * admission: the admission control state
+ * stats: the server statistics
+ * binary: set to 1 if the pending client uses the binary protocol
+ *
+ * Returns: the pending client socket, -1 if the slot was released
+ */
+int next_pending_client(Admission* admission, ServerStats* stats, 
+	int* binary) {
+    int client = -1;
+    pthread_mutex_lock(&admission->lock);
+    while (client == -1 && admission->count > 0) {
+	PendingClient pending = admission->pending[admission->head];
+	admission->head = (admission->head + 1) % MAX_PENDING_CLIENTS;
+	admission->count--;
+	long waitMs = elapsed_ms(&pending.queuedAt);
+	pthread_mutex_lock(&stats->lock);
+	stats->queued--;
+	pthread_mutex_unlock(&stats->lock);
+	if (waitMs > PENDING_TIMEOUT_MS || admission->draining) {
+	    reject_client(admission, stats, pending.client, pending.binary);
+	    continue;
+	}
+	client = pending.client;
+	*binary = pending.binary;
+	pthread_mutex_lock(&stats->lock);
+	stats->queueWaitTotalMs += waitMs;
+	if (waitMs > stats->queueWaitMaxMs) {
+	    stats->queueWaitMaxMs = waitMs;
+	}
+	pthread_mutex_unlock(&stats->lock);
+    }
+    if (client == -1) {
+	admission->active--;
+	pthread_cond_broadcast(&admission->idle);
+	pthread_mutex_lock(&stats->lock);
+	stats->connected--;
+	pthread_mutex_unlock(&stats->lock);
+    }
+    pthread_mutex_unlock(&admission->lock);
+    return client;
+}
+
+/* track_client()
+ * −−−−−−−−−−−−−−−
+ * Records that a client is being served, so it can be told to finish when
+ * the server drains. A client starting while the server drains is told to
+ * finish straight away.
+ *
+ * admission: the admission control state
+ * client: the client socket
+ */
+void track_client(Admission* admission, int client) {
+    pthread_mutex_lock(&admission->lock);
+    if (admission->clientCount == admission->clientCapacity) {
+	admission->clientCapacity = admission->clientCapacity == 0 ? 
+		MAX_PENDING_CLIENTS : admission->clientCapacity * 2;
+	admission->clients = realloc(admission->clients, 
+		sizeof(int) * admission->clientCapacity);
+    }
+    admission->clients[admission->clientCount++] = client;
+    if (admission->draining) {
+	shutdown(client, SHUT_RD);
+    }
+    pthread_mutex_unlock(&admission->lock);
+}
+
+/* untrack_client()
+ * −−−−−−−−−−−−−−−
+ * Records that a client is no longer being served. Must be called before
+ * the client socket is closed, as its descriptor may then be reused.
+ *
+ * admission: the admission control state
+ * client: the client socket
+ */
+void untrack_client(Admission* admission, int client) {
+    pthread_mutex_lock(&admission->lock);
+    for (int i = 0; i < admission->clientCount; i++) {
+	if (admission->clients[i] == client) {
+	    admission->clients[i] = 
+		    admission->clients[--admission->clientCount];
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&admission->lock);
+}
+
+/* drain_clients()
+ * −−−−−−−−−−−−−−−
+ * Waits for the clients being served to finish, for at most 
+ * DRAIN_TIMEOUT_SECS. Shutting down the reading side of each client lets
+ * requests already received be answered while idle connections see EOF 
+ * straight away. Once no client holds a connection slot, only replicas 
+ * (which hold none) remain, so the replication log is closed and they 
+ * disconnect after receiving the last changes.
+ *
+ * admission: the admission control state
+ * log: the replication log, NULL if none
+ */
+void drain_clients(Admission* admission, ReplicationLog* log) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&admission->lock);
+    admission->draining = 1;
+    for (int i = 0; i < admission->clientCount; i++) {
+	shutdown(admission->clients[i], SHUT_RD);
+    }
+    while ((admission->active > 0 || admission->clientCount > 0) && 
+	    elapsed_ms(&start) < DRAIN_TIMEOUT_SECS * MS_PER_SEC) {
+	if (log != NULL && admission->active == 0) {
+	    close_replication_log(log);
+	}
+	// Replication streams ending are not signalled, so wait in steps
+	struct timespec wait;
+	clock_gettime(CLOCK_REALTIME, &wait);
+	wait.tv_nsec += DRAIN_POLL_MS * NS_PER_MS;
+	wait.tv_sec += wait.tv_nsec / (MS_PER_SEC * NS_PER_MS);
+	wait.tv_nsec %= MS_PER_SEC * NS_PER_MS;
+	pthread_cond_timedwait(&admission->idle, &admission->lock, &wait);
+    }
+    pthread_mutex_unlock(&admission->lock);
+    if (log != NULL) {
+	close_replication_log(log);
+    }
+}
+
+/* disconnect_client()
+ * −−−−−−−−−−−−−−−
+ * Closes any open file descriptors and streams.
+ * 
+ * stats: the server statistics
+ * toClient: file descriptor writing to client
+ * fromClient: file stream reading from client
+ */
+void disconnect_client(ServerStats* stats, int toClient, FILE* fromClient) {
+    // Reads which failed with EAGAIN hit the client timeout
+    int timedOut = ferror(fromClient) && 
+	    (errno == EAGAIN || errno == EWOULDBLOCK);
+    // Closes all file descriptors and streams
+    fclose(fromClient);
+    close(toClient);
+    // Indicate that client is completed and has finished connecting
+    pthread_mutex_lock(&stats->lock);
+    stats->completed++;
+    if (timedOut) {
+	stats->timeouts++;
+    }
+    pthread_mutex_unlock(&stats->lock);
+}
+
+/* free_request()
+ * −−−−−−−−−−−−−−−
+ * Frees the parts of a HTTP request read from the client
+ *
+ * method: the request type
+ * address: the request address URL
+ * headers: the HTTP request headers
+ * body: the HTTP request body
+ */
+void free_request(char* method, char* address, HttpHeader** headers, 
+	char* body) {
+    free(method);
+    free(address);
+    free(body);
+    free_array_of_headers(headers);
+}
+
+/* buffer_reserve()
+ * −−−−−−−−−−−−−−−
+ * Makes room for more bytes at the end of a byte buffer
+ *
+ * buffer: the byte buffer
+ * extra: number of bytes to make room for
+ */
+void buffer_reserve(ByteBuffer* buffer, size_t extra) {
+    if (buffer->length + extra > buffer->capacity) {
+	while (buffer->length + extra > buffer->capacity) {
+	    buffer->capacity = buffer->capacity == 0 ? MAX_FRAME_BYTES : 
+		    buffer->capacity * 2;
+	}
+	buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+}
+
+/* buffer_put()
+ * −−−−−−−−−−−−−−−
+ * Appends bytes to a byte buffer
+ *
+ * buffer: the byte buffer
+ * bytes: the bytes to append
+ * length: number of bytes to append
+ */
+void buffer_put(ByteBuffer* buffer, const void* bytes, size_t length) {
+    buffer_reserve(buffer, length);
+    memcpy(buffer->data + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+/* buffer_put_u16(), buffer_put_u32(), buffer_put_u64()
+ * −−−−−−−−−−−−−−−
+ * Appends an integer to a byte buffer in network byte order
+ *
+ * buffer: the byte buffer
+ * value: the integer to append
+ */
+void buffer_put_u16(ByteBuffer* buffer, uint16_t value) {
+    uint16_t networkValue = htons(value);
+    buffer_put(buffer, &networkValue, sizeof(networkValue));
+}
+
+void buffer_put_u32(ByteBuffer* buffer, uint32_t value) {
+    uint32_t networkValue = htonl(value);
+    buffer_put(buffer, &networkValue, sizeof(networkValue));
+}
+
+void buffer_put_u64(ByteBuffer* buffer, uint64_t value) {
+    buffer_put_u32(buffer, (uint32_t)(value >> 32));
+    buffer_put_u32(buffer, (uint32_t)value);
+}
+
+/* begin_frame()
+ * −−−−−−−−−−−−−−−
+ * Starts a new length-prefixed frame at the end of a byte buffer
+ *
+ * buffer: the byte buffer
+ */
+void begin_frame(ByteBuffer* buffer) {
+    buffer->frameStart = buffer->length;
+    buffer_put_u32(buffer, 0); // Length is filled in by end_frame()
+}
+
+/* end_frame()
+ * −−−−−−−−−−−−−−−
+ * Fills in the length prefix of the frame started by begin_frame()
+ *
+ * buffer: the byte buffer
+ */
+void end_frame(ByteBuffer* buffer) {
+    uint32_t length = htonl(buffer->length - buffer->frameStart - 
+	    sizeof(uint32_t));
+    memcpy(buffer->data + buffer->frameStart, &length, sizeof(length));
+}
+
+/* put_record()
+ * −−−−−−−−−−−−−−−
+ * Encodes a record into the current frame of a byte buffer as: type (8 
+ * bits), sequence number (64 bits), version (64 bits), database name 
+ * length (16 bits), key length (32 bits), value length (32 bits), database
+ * name, key, value. The value may hold any bytes.
+ *
+ * buffer: the byte buffer
+ * type: the record type
+ * seq: sequence number of the change, 0 for snapshot records
+ * version: version of the key, or of the database for DATABASE_RECORD
+ * database: the database name, NULL if none
+ * key: the key, NULL if none
+ * value: the value, NULL if none
+ * valueLength: length of the value
+ */
+void put_record(ByteBuffer* buffer, int type, uint64_t seq, 
+	uint64_t version, const char* database, const char* key, 
+	const char* value, size_t valueLength) {
+    size_t databaseLength = database == NULL ? 0 : strlen(database);
+    size_t keyLength = key == NULL ? 0 : strlen(key);
+    uint8_t recordType = type;
+    buffer_put(buffer, &recordType, sizeof(recordType));
+    buffer_put_u64(buffer, seq);
+    buffer_put_u64(buffer, version);
+    buffer_put_u16(buffer, databaseLength);
+    buffer_put_u32(buffer, keyLength);
+    buffer_put_u32(buffer, valueLength);
+    buffer_put(buffer, database, databaseLength);
+    buffer_put(buffer, key, keyLength);
+    buffer_put(buffer, value, valueLength);
+}
+
+/* put_change()
+ * −−−−−−−−−−−−−−−
+ * Encodes a change into the current frame of a byte buffer, as by 
+ * put_record()
+ *
+ * buffer: the byte buffer
+ * type: the record type
+ * seq: sequence number of the change, 0 for snapshot records
+ * version: version of the key, or of the database for DATABASE_RECORD
+ * database: the database name
+ * key: the key, NULL if none
+ * value: the value, NULL if none
+ */
+void put_change(ByteBuffer* buffer, int type, uint64_t seq, 
+	uint64_t version, const char* database, const char* key, 
+	const char* value) {
+    put_record(buffer, type, seq, version, database, key, value, 
+	    value == NULL ? 0 : strlen(value));
+}
+
+/* write_all()
+ * −−−−−−−−−−−−−−−
+ * Writes the whole of a buffer to a file descriptor
+ *
+ * fd: the file descriptor
+ * data: the data to write
+ * length: number of bytes to write
+ *
+ * Returns: 1 if everything was written, 0 on error
+ */
+int write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+	ssize_t written = write(fd, data, length);
+	if (written <= 0) {
+	    return 0;
+	}
+	data += written;
+	length -= written;
+    }
+    return 1;
+}
+
+/* Arguments passed to snapshot_entry() */
+typedef struct SnapshotArgs {
+    ByteBuffer* buffer;
+    const char* database;
+} SnapshotArgs;
+
+/* snapshot_entry()
+ * −−−−−−−−−−−−−−−
+ * Encodes a key/value pair into a snapshot, starting a new frame when the
+ * current one is full
+ *
+ * key: the key
+ * value: the value
+ * version: the version of the key
+ * arg: the snapshot arguments
+ */
+void snapshot_entry(const char* key, const char* value, uint64_t version,
+	void* arg) {
+    SnapshotArgs* args = (SnapshotArgs*)arg;
+    put_change(args->buffer, CHANGE_PUT, 0, version, args->database, key, 
+	    value);
+    if (args->buffer->length - args->buffer->frameStart > MAX_FRAME_BYTES) {
+	end_frame(args->buffer);
+	begin_frame(args->buffer);
+    }
+}
+
+/* send_snapshot()
+ * −−−−−−−−−−−−−−−
+ * Sends a snapshot of every database to a replica, or to the server taking
+ * over from this one. Each database is scanned SNAPSHOT_SCAN_BUCKETS 
+ * buckets at a time, copying each slice into a buffer under the database
+ * lock and sending it after the lock is released. Changes made while the
+ * snapshot is taken are replayed from the log afterwards; since replaying
+ * is idempotent, the replica converges. Databases are sent in id order, so
+ * the receiver gives them the same binary protocol ids.
+ *
+ * databases: the database map
+ * toReplica: file descriptor writing to the replica
+ * offset: set to the offset in the log to stream changes from, 0 if there
+ *         is no log
+ *
+ * Returns: 1 if the snapshot was sent, 0 on error
+ */
+int send_snapshot(DatabaseMap* databases, int toReplica, uint64_t* offset) {
+    ReplicationLog* log = databases->log;
+    *offset = 0;
+    if (log != NULL) {
+	pthread_mutex_lock(&log->lock);
+	*offset = log->nextSeq - 1;
+	pthread_mutex_unlock(&log->lock);
+    }
+
+    ByteBuffer buffer = {NULL, 0, 0, 0};
+    begin_frame(&buffer);
+    put_change(&buffer, SNAPSHOT_BEGIN, 0, 0, NULL, NULL, NULL);
+    end_frame(&buffer);
+    int ok = write_all(toReplica, buffer.data, buffer.length);
+
+    // Databases are never removed, so they can be visited after unlocking
+    pthread_rwlock_rdlock(&databases->lock);
+    int count = databases->count;
+    Database** list = malloc(sizeof(Database*) * count);
+    memcpy(list, databases->byId, sizeof(Database*) * count);
+    pthread_rwlock_unlock(&databases->lock);
+
+    for (int i = 0; ok && i < count; i++) {
+	buffer.length = 0;
+	begin_frame(&buffer);
+	// The receiver needs the database's authorization and the versions
+	// issued so far, so versions it issues later are never reused
+	pthread_mutex_lock(&list[i]->lock);
+	put_change(&buffer, DATABASE_RECORD, 0, 
+		stringstore_version(list[i]->store), list[i]->name, 
+		list[i]->authString == NULL ? NULL : DATABASE_PROTECTED, 
+		list[i]->authString);
+	pthread_mutex_unlock(&list[i]->lock);
+	SnapshotArgs args = {&buffer, list[i]->name};
+	uint64_t cursor = 0;
+	do {
+	    pthread_mutex_lock(&list[i]->lock);
+	    cursor = stringstore_scan(list[i]->store, cursor, 
+		    SNAPSHOT_SCAN_BUCKETS, snapshot_entry, &args);
+	    pthread_mutex_unlock(&list[i]->lock);
+	    end_frame(&buffer);
+	    ok = write_all(toReplica, buffer.data, buffer.length);
+	    buffer.length = 0;
+	    begin_frame(&buffer);
+	} while (ok && cursor != 0);
+    }
+
+    buffer.length = 0;
+    begin_frame(&buffer);
+    put_change(&buffer, SNAPSHOT_END, *offset, 0, NULL, NULL, NULL);
+    end_frame(&buffer);
+    ok = ok && write_all(toReplica, buffer.data, buffer.length);
+    free(buffer.data);
+    free(list);
+    return ok;
+}
+
+/* stream_changes()
+ * −−−−−−−−−−−−−−−
+ * Streams changes from the replication log to a replica in batches until 
+ * the replica disconnects or falls so far behind that the changes it needs 
+ * have been overwritten. An empty frame is sent as a heartbeat whenever 
+ * there are no changes for HEARTBEAT_SECS.
+ *
+ * log: the replication log
+ * toReplica: file descriptor writing to the replica
+ * offset: sequence number of the last change the replica has
+ */
+void stream_changes(ReplicationLog* log, int toReplica, uint64_t offset) {
+    ByteBuffer buffer = {NULL, 0, 0, 0};
+    for (;;) {
+	pthread_mutex_lock(&log->lock);
+	if (log->nextSeq - 1 == offset && log->closed == 0) {
+	    struct timespec deadline;
+	    clock_gettime(CLOCK_REALTIME, &deadline);
+	    deadline.tv_sec += HEARTBEAT_SECS;
+	    pthread_cond_timedwait(&log->changed, &log->lock, &deadline);
+	}
+	if (offset + 1 < log->nextSeq - log->count) {
+	    pthread_mutex_unlock(&log->lock);
+	    break; // Replica must reconnect and take a snapshot
+	}
+	if (log->closed && log->nextSeq - 1 == offset) {
+	    pthread_mutex_unlock(&log->lock);
+	    break; // Replica has every change made before shutdown
+	}
+	// Encode every available change, up to one batch or frame
+	buffer.length = 0;
+	begin_frame(&buffer);
+	for (int i = 0; i < MAX_BATCH_RECORDS && offset + 1 < log->nextSeq &&
+		buffer.length < MAX_FRAME_BYTES; i++) {
+	    ChangeRecord* record = 
+		    &log->records[++offset % REPLICATION_LOG_SIZE];
+	    put_record(&buffer, record->type, record->seq, record->version,
+		    record->database, record->key, record->value, 
+		    record->valueLength);
+	}
+	end_frame(&buffer);
+	pthread_mutex_unlock(&log->lock);
+	if (write_all(toReplica, buffer.data, buffer.length) == 0) {
+	    break;
+	}
+    }
+    free(buffer.data);
+}
+
+/* replicate_to_replica()
+ * −−−−−−−−−−−−−−−
+ * Handles a replication request ("GET /_replicate?offset=N&log=ID") by 
+ * streaming the change log to the replica from the offset it has applied
+ * until the replica disconnects or the server shuts down.
+ * If those changes are no longer in the log, or the offset is into the log
+ * of a previous run, a snapshot is sent first. The response body is the id
+ * of the log, for the replica to send when it reconnects.
+ *
+ * databases: the database map
+ * address: the request address URL
+ * toReplica: file descriptor writing to the replica
+ */
+void replicate_to_replica(DatabaseMap* databases, char* address, 
+	int toReplica) {
+    ReplicationLog* log = databases->log;
+    if (databases->readOnly || log == NULL) {
+	send_empty_http_response(METHOD_NOT_ALLOWED_STATUS, 
+		METHOD_NOT_ALLOWED_EXPLAIN, toReplica);
+	return;
+    }
+    uint64_t offset = 0;
+    char* offsetParameter = strstr(address, OFFSET_PARAMETER);
+    if (offsetParameter != NULL) {
+	offset = strtoull(offsetParameter + strlen(OFFSET_PARAMETER), NULL, 
+		BASE_10);
+    }
+    char* logIdParameter = strstr(address, LOG_ID_PARAMETER);
+    int sameLog = logIdParameter != NULL && strncmp(logIdParameter + 
+	    strlen(LOG_ID_PARAMETER), log->id, strlen(log->id)) == 0;
+    send_value_http_response(log->id, 0, toReplica);
+
+    pthread_mutex_lock(&log->lock);
+    int needsSnapshot = sameLog == 0 || offset > log->nextSeq - 1 || 
+	    offset + 1 < log->nextSeq - log->count;
+    pthread_mutex_unlock(&log->lock);
+    if (needsSnapshot && send_snapshot(databases, toReplica, &offset) == 0) {
+	return;
+    }
+    stream_changes(log, toReplica, offset);
+}
+
+/* stream_to_replica()
+ * −−−−−−−−−−−−−−−
+ * Serves a replication request on its own thread, so the replica does not
+ * hold a connection slot for as long as it streams
+ *
+ * arg: the stream arguments
+ */
+void* stream_to_replica(void* arg) {
+    StreamParameters* stream = (StreamParameters*)arg;
+    replicate_to_replica(stream->databases, stream->address, 
+	    stream->toReplica);
+    untrack_client(stream->admission, stream->toReplica);
+    close(stream->toReplica);
+    free(stream->address);
+    free(stream);
+    return NULL;
+}
+
+/* start_stream()
+ * −−−−−−−−−−−−−−−
+ * Hands a replication request over to a thread of its own, releasing the
+ * client's connection slot once the client handling thread moves on. The
+ * stream is tracked so that draining waits for it.
+ *
+ * arguments: arguments passed to the client handling thread
+ * address: the request address URL
+ * toClient: the client socket
+ */
+void start_stream(ThreadParameters* arguments, char* address, 
+	int toClient) {
+    StreamParameters* stream = malloc(sizeof(StreamParameters));
+    stream->databases = arguments->databases;
+    stream->admission = arguments->admission;
+    stream->address = strdup(address);
+    stream->toReplica = dup(toClient);
+    track_client(arguments->admission, stream->toReplica);
+    pthread_t threadId;
+    pthread_create(&threadId, NULL, stream_to_replica, stream);
+    pthread_detach(threadId);
+}
+
+/* read_u16(), read_u32(), read_u64()
+ * −−−−−−−−−−−−−−−
+ * Reads an integer in network byte order from a frame
+ *
+ * frame: the frame being read
+ * position: offset in the frame, advanced past the integer
+ * length: length of the frame
+ * value: set to the integer read
+ *
+ * Returns: 1 if the integer was read, 0 if the frame is too short
+ */
+int read_u16(const char* frame, size_t* position, size_t length, 
+	uint16_t* value) {
+    if (*position + sizeof(*value) > length) {
+	return 0;
+    }
+    memcpy(value, frame + *position, sizeof(*value));
+    *value = ntohs(*value);
+    *position += sizeof(*value);
+    return 1;
+}
+
+int read_u32(const char* frame, size_t* position, size_t length, 
+	uint32_t* value) {
+    if (*position + sizeof(*value) > length) {
+	return 0;
+    }
+    memcpy(value, frame + *position, sizeof(*value));
+    *value = ntohl(*value);
+    *position += sizeof(*value);
+    return 1;
+}
+
+int read_u64(const char* frame, size_t* position, size_t length, 
+	uint64_t* value) {
+    uint32_t high, low;
+    if (!read_u32(frame, position, length, &high) || 
+	    !read_u32(frame, position, length, &low)) {
+	return 0;
+    }
+    *value = ((uint64_t)high << 32) | low;
+    return 1;
+}
+
+/* finish_snapshot()
+ * −−−−−−−−−−−−−−−
+ * Stops receiving a snapshot. If it is complete, each database's staged 
+ * store replaces its store under the database lock (databases missing 
+ * from the snapshot are emptied), otherwise the staged stores are freed.
+ * Does nothing if no snapshot is being received.
+ *
+ * databases: the database map
+ * complete: 1 if the whole snapshot was received, 0 otherwise
+ */
+void finish_snapshot(DatabaseMap* databases, int complete) {
+    if (databases->staging == 0) {
+	return;
+    }
+    databases->staging = 0;
+    // Databases are never removed, so they can be visited after unlocking
+    pthread_rwlock_rdlock(&databases->lock);
+    int count = databases->count;
+    Database** list = malloc(sizeof(Database*) * count);
+    memcpy(list, databases->byId, sizeof(Database*) * count);
+    pthread_rwlock_unlock(&databases->lock);
+
+    for (int i = 0; i < count; i++) {
+	StringStore* staged = list[i]->staged;
+	list[i]->staged = NULL;
+	if (complete == 0) {
+	    if (staged != NULL) {
+		stringstore_free(staged);
+	    }
+	    continue;
+	}
+	if (staged == NULL) {
+	    staged = stringstore_init();
+	}
+	pthread_mutex_lock(&list[i]->lock);
+	StringStore* old = list[i]->store;
+	list[i]->store = staged;
+	for (int stripe = 0; stripe < EPOCH_STRIPES; stripe++) {
+	    __atomic_add_fetch(&list[i]->epochs[stripe], 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&list[i]->lock);
+	// Freed unlocked, as no client can reach the old store any more
+	stringstore_free(old);
+    }
+    free(list);
+}
+
+/* begin_snapshot()
+ * −−−−−−−−−−−−−−−
+ * Starts receiving a snapshot. Its entries are added to staged stores, 
+ * created as they are needed, rather than the stores clients are served 
+ * from. Any partly received earlier snapshot is discarded.
+ *
+ * databases: the database map
+ */
+void begin_snapshot(DatabaseMap* databases) {
+    finish_snapshot(databases, 0);
+    databases->staging = 1;
+}
+
+/* apply_change()
+ * −−−−−−−−−−−−−−−
+ * Applies a change received from the primary (or the server being taken 
+ * over from) to the databases. Keys keep the versions they have on the 
+ * primary, so ETags can be used with either server. Databases requiring
+ * authorization on the primary require the same authorization here, 
+ * unless they were declared with their own. Snapshots are staged and only
+ * replace the data clients see once complete.
+ *
+ * databases: the database map
+ * type: the record type
+ * version: the version of the key, or of the database for DATABASE_RECORD
+ * database: the database name
+ * key: the key
+ * value: the value
+ */
+void apply_change(DatabaseMap* databases, int type, uint64_t version, 
+	char* database, char* key, char* value) {
+    if (type == SNAPSHOT_BEGIN) {
+	begin_snapshot(databases);
+	return;
+    } 
+    if (type == SNAPSHOT_END) {
+	finish_snapshot(databases, 1);
+	return;
+    }
+    Database* target = get_database(databases, database, 
+	    type == CHANGE_PUT || type == DATABASE_RECORD);
+    if (target == NULL) {
+	return;
+    }
+    // Snapshot entries go to the staged store, which only this thread uses
+    StringStore* staged = NULL;
+    if (databases->staging) {
+	if (target->staged == NULL) {
+	    target->staged = stringstore_init();
+	}
+	staged = target->staged;
+    }
+    if (type == DATABASE_RECORD) {
+	pthread_mutex_lock(&target->lock);
+	if (strcmp(key, DATABASE_PROTECTED) == 0 && 
+		target->authString == NULL) {
+	    // Published atomically as clients check it without the lock
+	    __atomic_store_n(&target->authString, strdup(value), 
+		    __ATOMIC_RELEASE);
+	}
+	stringstore_advance_version(staged == NULL ? target->store : staged,
+		version);
+	pthread_mutex_unlock(&target->lock);
+	return;
+    }
+    if (staged != NULL) {
+	if (type == CHANGE_PUT) {
+	    stringstore_add_at_version(staged, key, value, version);
+	}
+	return;
+    }
+    pthread_mutex_lock(&target->lock);
+    if (type == CHANGE_PUT) {
+	stringstore_add_at_version(target->store, key, value, version);
+    } else if (type == CHANGE_DELETE) {
+	stringstore_delete(target->store, key);
+    }
+    record_change(target, type, key, value, version);
+    pthread_mutex_unlock(&target->lock);
+}
+
+/* apply_frame()
+ * −−−−−−−−−−−−−−−
+ * Decodes and applies every change in a frame received from the primary
+ *
+ * replica: the replication state, whose offset is advanced
+ * frame: the frame payload
+ * length: length of the frame payload
+ *
+ * Returns: 1 if the frame was applied, 0 if it is malformed
+ */
+int apply_frame(ReplicaParameters* replica, const char* frame, 
+	size_t length) {
+    size_t position = 0;
+    while (position < length) {
+	uint8_t type;
+	uint64_t seq, version;
+	uint16_t databaseLength;
+	uint32_t keyLength, valueLength;
+	type = frame[position++];
+	if (!read_u64(frame, &position, length, &seq) || 
+		!read_u64(frame, &position, length, &version) ||
+		!read_u16(frame, &position, length, &databaseLength) ||
+		!read_u32(frame, &position, length, &keyLength) ||
+		!read_u32(frame, &position, length, &valueLength) ||
+		(uint64_t)position + databaseLength + keyLength + 
+		valueLength > length) {
+	    return 0;
+	}
+	// A batch's value holds the changes in it
+	if (type == CHANGE_BATCH) {
+	    position += databaseLength + keyLength;
+	    if (apply_frame(replica, frame + position, valueLength) == 0) {
+		return 0;
+	    }
+	    position += valueLength;
+	    replica->offset = seq;
+	    continue;
+	}
+	char* database = strndup(frame + position, databaseLength);
+	position += databaseLength;
+	char* key = strndup(frame + position, keyLength);
+	position += keyLength;
+	char* value = strndup(frame + position, valueLength);
+	position += valueLength;
+	apply_change(replica->databases, type, version, database, key, 
+		value);
+	if (type == SNAPSHOT_END) {
+	    // Offsets are only meaningful within the log they came from
+	    free(replica->logId);
+	    replica->logId = strdup(replica->primaryLogId);
+	}
+	free(database);
+	free(key);
+	free(value);
+	// Snapshot entries have no sequence number
+	if (seq != 0) {
+	    replica->offset = seq;
+	}
+    }
+    return 1;
+}
+
+/* apply_frames()
+ * −−−−−−−−−−−−−−−
+ * Reads and applies length-prefixed frames until the stream ends or a 
+ * frame is malformed
+ *
+ * replica: the replication state
+ * from: the stream to read frames from
+ * frame: buffer to read frames into
+ */
+void apply_frames(ReplicaParameters* replica, FILE* from, ByteBuffer* frame) {
+    uint32_t length;
+    while (fread(&length, sizeof(length), 1, from) == 1) {
+	length = ntohl(length);
+	frame->length = 0;
+	buffer_reserve(frame, length);
+	if (length > 0 && fread(frame->data, length, 1, from) != 1) {
+	    break;
+	}
+	if (apply_frame(replica, frame->data, length) == 0) {
+	    break;
+	}
+    }
+}
+
+/* connect_to_primary()
+ * −−−−−−−−−−−−−−−
+ * Connects to the primary server
+ *
+ * host: the primary's host name
+ * port: the primary's port number
+ *
+ * Returns: the connected socket, -1 on failure
+ */
+int connect_to_primary(char* host, char* port) {
+    struct addrinfo* ai = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &ai)) {
+	return -1;
+    }
+    int primary = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(primary, ai->ai_addr, sizeof(struct sockaddr))) {
+	close(primary);
+	primary = -1;
+    }
+    freeaddrinfo(ai);
+    return primary;
+}
+
+/* replicate_from_primary()
+ * −−−−−−−−−−−−−−−
+ * Connects to the primary and applies its change stream, reconnecting from
+ * the last applied offset whenever the connection is lost. Runs forever.
+ *
+ * arg: the replication state
+ */
+void* replicate_from_primary(void* arg) {
+    ReplicaParameters* replica = (ReplicaParameters*)arg;
+    ByteBuffer frame = {NULL, 0, 0, 0};
+    for (;; sleep(REPLICA_RETRY_SECS)) {
+	int toPrimary = connect_to_primary(replica->host, replica->port);
+	if (toPrimary < 0) {
+	    continue;
+	}
+	// Heartbeats arrive every HEARTBEAT_SECS from a live primary
+	struct timeval timeout;
+	timeout.tv_sec = REPLICA_TIMEOUT_SECS;
+	timeout.tv_usec = 0;
+	setsockopt(toPrimary, SOL_SOCKET, SO_RCVTIMEO, &timeout, 
+		sizeof(timeout));
+	FILE* fromPrimary = fdopen(dup(toPrimary), "r");
+	char* request;
+	size_t requestLength;
+	FILE* requestStream = open_memstream(&request, &requestLength);
+	fprintf(requestStream, "GET " REPLICATE_ADDRESS "?" OFFSET_PARAMETER 
+		"%" PRIu64 "&" LOG_ID_PARAMETER "%s HTTP/1.1\r\n"
+		"Authorization: %s\r\n\r\n", replica->offset, 
+		replica->logId == NULL ? "" : replica->logId, 
+		replica->authString);
+	fclose(requestStream);
+	// A primary that has reset the connection must not raise SIGPIPE
+	send(toPrimary, request, requestLength, MSG_NOSIGNAL);
+	free(request);
+
+	int status;
+	char* statusExplain, *body;
+	HttpHeader** headers;
+	if (get_HTTP_response(fromPrimary, &status, &statusExplain, &headers,
+		&body) == 1) {
+	    free(statusExplain);
+	    free_array_of_headers(headers);
+	    free(replica->primaryLogId);
+	    replica->primaryLogId = body;
+	    if (status == OK_STATUS) {
+		apply_frames(replica, fromPrimary, &frame);
+		// A snapshot cut short is sent again after reconnecting
+		finish_snapshot(replica->databases, 0);
+	    }
+	}
+	fclose(fromPrimary);
+	close(toPrimary);
+    }
+    return NULL;
+}
+
+/* start_replica()
+ * −−−−−−−−−−−−−−−
+ * Makes the server a read-only replica of the primary at host:port and 
+ * starts the thread replicating from it
+ *
+ * databases: the database map
+ * primary: the primary's address, as host:port
+ * authString: the authorization string the primary requires
+ */
+void start_replica(DatabaseMap* databases, char* primary, char* authString) {
+    ReplicaParameters* replica = malloc(sizeof(ReplicaParameters));
+    char* separator = strrchr(primary, ':');
+    replica->host = strndup(primary, separator - primary);
+    replica->port = strdup(separator + 1);
+    replica->databases = databases;
+    replica->offset = 0;
+    replica->logId = NULL;
+    replica->primaryLogId = NULL;
+    replica->authString = authString;
+    databases->readOnly = 1;
+    pthread_t threadId;
+    pthread_create(&threadId, NULL, replicate_from_primary, replica);
+    pthread_detach(threadId);
+}
+
+/* get_database_by_id()
+ * −−−−−−−−−−−−−−−
+ * Looks up a database by its binary protocol id
+ *
+ * map: the database map
+ * id: the database id
+ *
+ * Returns: the database, NULL if there is no database with that id
+ */
+Database* get_database_by_id(DatabaseMap* map, unsigned int id) {
+    Database* database = NULL;
+    pthread_rwlock_rdlock(&map->lock);
+    if (id < (unsigned int)map->count) {
+	database = map->byId[id];
+    }
+    pthread_rwlock_unlock(&map->lock);
+    return database;
+}
+
+/* put_binary_response()
+ * −−−−−−−−−−−−−−−
+ * Appends a binary protocol response to a byte buffer: status (16 bits, 
+ * using HTTP status codes), reserved (16 bits), value length (32 bits), 
+ * value.
+ *
+ * output: the byte buffer
+ * status: the response status
+ * value: the value, NULL if none
+ * length: length of the value
+ */
+void put_binary_response(ByteBuffer* output, int status, const char* value,
+	uint32_t length) {
+    buffer_put_u16(output, status);
+    buffer_put_u16(output, 0);
+    buffer_put_u32(output, length);
+    buffer_put(output, value, length);
+}
+
+/* binary_authorized()
+ * −−−−−−−−−−−−−−−
+ * Checks if a binary protocol connection may use a database, responding 
+ * with 401 if not. Must be called while holding the database lock.
+ *
+ * connection: the binary protocol connection
+ * database: the database
+ *
+ * Returns: 1 if the connection is authorized, 0 otherwise
+ */
+int binary_authorized(BinaryConnection* connection, Database* database) {
+    if (database->authString == NULL || 
+	    connection->authorized[database->id]) {
+	return 1;
+    }
+    database->authFails++;
+    put_binary_response(&connection->output, UNAUTHORIZED_STATUS, NULL, 0);
+    return 0;
+}
+
+/* binary_multi_get()
+ * −−−−−−−−−−−−−−−
+ * Looks up several keys under one acquisition of the database lock. The 
+ * keys are given as a sequence of 32 bit lengths each followed by a key.
+ * The response value holds, for each key, a 32 bit length followed by the
+ * value, with BINARY_MISSING_VALUE as the length of missing keys.
+ *
+ * connection: the binary protocol connection
+ * database: the database, locked by the caller
+ * keys: the encoded keys
+ * length: length of the encoded keys
+ */
+void binary_multi_get(BinaryConnection* connection, Database* database, 
+	const char* keys, uint32_t length) {
+    ByteBuffer* output = &connection->output;
+    size_t responseStart = output->length;
+    put_binary_response(output, OK_STATUS, NULL, 0);
+    size_t valuesStart = output->length;
+    size_t position = 0;
+    uint32_t keyLength;
+    while (position < length) {
+	if (!read_u32(keys, &position, length, &keyLength) || 
+		keyLength > length - position) {
+	    // Discard the partial response
+	    output->length = responseStart;
+	    put_binary_response(output, BAD_STATUS, NULL, 0);
+	    return;
+	}
+	char* key = strndup(keys + position, keyLength);
+	position += keyLength;
+	const char* value = stringstore_retrieve(database->store, key);
+	free(key);
+	if (value == NULL) {
+	    buffer_put_u32(output, BINARY_MISSING_VALUE);
+	} else {
+	    uint32_t valueLength = strlen(value);
+	    buffer_put_u32(output, valueLength);
+	    buffer_put(output, value, valueLength);
+	    database->getOps++; // successful GET request processed
+	}
+    }
+    // Fill in the length of the response value
+    uint32_t valuesLength = htonl(output->length - valuesStart);
+    memcpy(output->data + valuesStart - sizeof(valuesLength), &valuesLength,
+	    sizeof(valuesLength));
+}
+
+/* process_binary_operation()
+ * −−−−−−−−−−−−−−−
+ * Processes a GET, PUT, DELETE or multi-get binary request on a database,
+ * with the same semantics as the HTTP requests, and appends the response
+ *
+ * connection: the binary protocol connection
+ * database: the database
+ * opcode: the request opcode
+ * key: the key (the encoded keys for a multi-get)
+ * keyLength: length of the key
+ * value: the value
+ * valueLength: length of the value
+ */
+void process_binary_operation(BinaryConnection* connection, 
+	Database* database, int opcode, const char* key, uint32_t keyLength,
+	const char* value, uint32_t valueLength) {
+    ByteBuffer* output = &connection->output;
+    pthread_mutex_lock(&database->lock);
+    if (binary_authorized(connection, database) == 0) {
+	pthread_mutex_unlock(&database->lock);
+	return;
+    }
+    if (opcode == BINARY_MULTI_GET) {
+	binary_multi_get(connection, database, key, keyLength);
+	pthread_mutex_unlock(&database->lock);
+	return;
+    }
+    // StringStore keys and values are strings
+    char* keyString = strndup(key, keyLength);
+    if (opcode == BINARY_GET) {
+	const char* stored = stringstore_retrieve(database->store, keyString);
+	if (stored == NULL) {
+	    put_binary_response(output, NOT_FOUND_STATUS, NULL, 0);
+	} else {
+	    put_binary_response(output, OK_STATUS, stored, strlen(stored));
+	    database->getOps++; // successful GET request processed
+	}
+    } else if (opcode == BINARY_PUT) {
+	char* valueString = strndup(value, valueLength);
+	uint64_t version = stringstore_add_versioned(database->store, 
+		keyString, valueString);
+	if (version == 0) {
+	    put_binary_response(output, INTERNAL_ERROR_STATUS, NULL, 0);
+	} else {
+	    database->putOps++; // successful PUT request processed
+	    record_change(database, CHANGE_PUT, keyString, valueString, 
+		    version);
+	    put_binary_response(output, OK_STATUS, NULL, 0);
+	}
+	free(valueString);
+    } else {
+	if (stringstore_delete(database->store, keyString) == 0) {
+	    put_binary_response(output, NOT_FOUND_STATUS, NULL, 0);
+	} else {
+	    database->deleteOps++; // successful DELETE request processed
+	    record_change(database, CHANGE_DELETE, keyString, NULL, 0);
+	    put_binary_response(output, OK_STATUS, NULL, 0);
+	}
+    }
+    free(keyString);
+    pthread_mutex_unlock(&database->lock);
+}
+
+/* process_binary_request()
+ * −−−−−−−−−−−−−−−
+ * Processes one binary protocol request and appends its response. 
+ * RESOLVE looks up (or with BINARY_CREATE_FLAG, creates) the database 
+ * named by the key and responds with its 32 bit id. AUTH authorizes the 
+ * connection to use a database if the value is its authorization string.
+ *
+ * databases: the database map
+ * connection: the binary protocol connection
+ * request: the request, starting with its header
+ */
+void process_binary_request(DatabaseMap* databases, 
+	BinaryConnection* connection, const char* request) {
+    ByteBuffer* output = &connection->output;
+    size_t position = 0;
+    uint8_t opcode = request[position++];
+    uint8_t flags = request[position++];
+    uint16_t databaseId;
+    uint32_t keyLength, valueLength;
+    read_u16(request, &position, BINARY_HEADER_BYTES, &databaseId);
+    read_u32(request, &position, BINARY_HEADER_BYTES, &keyLength);
+    read_u32(request, &position, BINARY_HEADER_BYTES, &valueLength);
+    const char* key = request + BINARY_HEADER_BYTES;
+    const char* value = key + keyLength;
+
+    // Keys and values are strings, so cannot contain NUL characters
+    if ((opcode != BINARY_MULTI_GET && memchr(key, '\0', keyLength)) || 
+	    memchr(value, '\0', valueLength) || opcode < BINARY_GET || 
+	    opcode > BINARY_AUTH) {
+	put_binary_response(output, BAD_STATUS, NULL, 0);
+	return;
+    }
+    if (databases->readOnly && (opcode == BINARY_PUT || 
+	    opcode == BINARY_DELETE)) {
+	put_binary_response(output, METHOD_NOT_ALLOWED_STATUS, NULL, 0);
+	return;
+    }
+    if (opcode == BINARY_RESOLVE) {
+	char* name = strndup(key, keyLength);
+	Database* database = NULL;
+	if (keyLength > 0 && strchr(name, '/') == NULL) {
+	    database = get_database(databases, name, 
+		    (flags & BINARY_CREATE_FLAG) && !databases->readOnly);
+	}
+	free(name);
+	if (database == NULL) {
+	    put_binary_response(output, NOT_FOUND_STATUS, NULL, 0);
+	} else {
+	    uint32_t id = htonl(database->id);
+	    put_binary_response(output, OK_STATUS, (char*)&id, sizeof(id));
+	}
+	return;
+    }
+
+    Database* database = get_database_by_id(databases, databaseId);
+    if (database == NULL) {
+	put_binary_response(output, NOT_FOUND_STATUS, NULL, 0);
+    } else if (opcode == BINARY_AUTH) {
+	pthread_mutex_lock(&database->lock);
+	if (database->authString == NULL || 
+		(strlen(database->authString) == valueLength && 
+		memcmp(database->authString, value, valueLength) == 0)) {
+	    connection->authorized[database->id] = 1;
+	    put_binary_response(output, OK_STATUS, NULL, 0);
+	} else {
+	    database->authFails++;
+	    put_binary_response(output, UNAUTHORIZED_STATUS, NULL, 0);
+	}
+	pthread_mutex_unlock(&database->lock);
+    } else {
+	process_binary_operation(connection, database, opcode, key, 
+		keyLength, value, valueLength);
+    }
+}
+
+/* serve_binary_client()
+ * −−−−−−−−−−−−−−−
+ * Processes binary protocol requests from a single client until it 
+ * disconnects, times out or sends a request that is too large. Each 
+ * request is a header of opcode (8 bits), flags (8 bits), database id (16
+ * bits), key length (32 bits) and value length (32 bits), followed by the 
+ * key and value. Requests may be pipelined: every complete request read 
+ * is processed and the responses are sent together in one write.
+ *
+ * arguments: arguments passed to the client handling thread
+ * client: the client socket
+ */
+void serve_binary_client(ThreadParameters* arguments, int client) {
+    BinaryConnection* connection = calloc(1, sizeof(BinaryConnection));
+    ByteBuffer* input = &connection->input;
+    track_client(arguments->admission, client);
+    for (;;) {
+	buffer_reserve(input, MAX_FRAME_BYTES);
+	ssize_t received = read(client, input->data + input->length, 
+		input->capacity - input->length);
+	if (received <= 0) {
+	    break;
+	}
+	input->length += received;
+
+	// Process every complete request in the buffer
+	size_t position = 0;
+	uint64_t requestLength = 0;
+	while (input->length - position >= BINARY_HEADER_BYTES) {
+	    size_t lengthPosition = position + sizeof(uint32_t);
+	    uint32_t keyLength, valueLength;
+	    read_u32(input->data, &lengthPosition, input->length, &keyLength);
+	    read_u32(input->data, &lengthPosition, input->length, 
+		    &valueLength);
+	    requestLength = (uint64_t)BINARY_HEADER_BYTES + keyLength + 
+		    valueLength;
+	    if (requestLength > input->length - position) {
+		break;
+	    }
+	    process_binary_request(arguments->databases, connection, 
+		    input->data + position);
+	    position += requestLength;
+	}
+	if (requestLength > MAX_BINARY_REQUEST_BYTES || 
+		write_all(client, connection->output.data, 
+		connection->output.length) == 0) {
+	    break;
+	}
+	connection->output.length = 0;
+	// Keep any partial request, making room for the rest of it
+	memmove(input->data, input->data + position, input->length - position);
+	input->length -= position;
+	if (requestLength > input->length) {
+	    buffer_reserve(input, requestLength - input->length);
+	}
+    }
+    free(input->data);
+    free(connection->output.data);
+    free(connection);
+    untrack_client(arguments->admission, client);
+    close(client);
+    pthread_mutex_lock(&arguments->stats->lock);
+    arguments->stats->completed++;
+    pthread_mutex_unlock(&arguments->stats->lock);
+}
+
+/* export_entry()
+ * −−−−−−−−−−−−−−−
+ * Encodes a key/value pair into an export stream as: key length (32 bits),
+ * value length (32 bits), key, value
+ *
+ * key: the key
+ * value: the value
+ * version: the version of the key, which is not exported
+ * arg: the byte buffer
+ */
+void export_entry(const char* key, const char* value, uint64_t version,
+	void* arg) {
+    ByteBuffer* buffer = (ByteBuffer*)arg;
+    size_t keyLength = strlen(key);
+    size_t valueLength = strlen(value);
+    buffer_put_u32(buffer, keyLength);
+    buffer_put_u32(buffer, valueLength);
+    buffer_put(buffer, key, keyLength);
+    buffer_put(buffer, value, valueLength);
+}
+
+/* write_chunk()
+ * −−−−−−−−−−−−−−−
+ * Writes the contents of a byte buffer as one chunk of a chunked HTTP 
+ * response body, then empties the buffer. An empty buffer is written as 
+ * the last chunk.
+ *
+ * toClient: file descriptor writing to connected client
+ * buffer: the byte buffer
+ *
+ * Returns: 1 if the chunk was written, 0 on error
+ */
+int write_chunk(int toClient, ByteBuffer* buffer) {
+    char size[INT64_LENGTH];
+    int sizeLength = sprintf(size, "%zx\r\n", buffer->length);
+    int ok = write_all(toClient, size, sizeLength) && 
+	    write_all(toClient, buffer->data, buffer->length) &&
+	    write_all(toClient, "\r\n", strlen("\r\n"));
+    buffer->length = 0;
+    return ok;
+}
+
+/* process_export_request()
+ * −−−−−−−−−−−−−−−
+ * Handles an export request ("GET /<database>/_export") by streaming every
+ * key/value pair as a chunked response. The stream starts with the number
+ * of keys (64 bits), followed by one record per key as encoded by 
+ * export_entry(). The store is scanned EXPORT_SCAN_BUCKETS buckets at a 
+ * time, taking the database lock for each slice and writing outside it, so
+ * other requests proceed during an export. Keys present for the whole 
+ * export are exported exactly once.
+ *
+ * database: the database
+ * toClient: file descriptor writing to connected client
+ */
+void process_export_request(Database* database, int toClient) {
+    trace_mark(TRACE_RESPONDING);
+    HttpHeader** headers = construct_empty_headers();
+    headers[0]->name = "Transfer-Encoding";
+    headers[0]->value = "chunked";
+    char* response = construct_HTTP_response(OK_STATUS, OK_EXPLAIN, 
+	    headers, NULL);
+    int ok = write_all(toClient, response, strlen(response));
+    free(response);
+    free_response_headers(headers);
+
+    ByteBuffer buffer = {NULL, 0, 0, 0};
+    pthread_mutex_lock(&database->lock);
+    database->getOps++;
+    buffer_put_u64(&buffer, stringstore_count(database->store));
+    pthread_mutex_unlock(&database->lock);
+    uint64_t cursor = 0;
+    do {
+	pthread_mutex_lock(&database->lock);
+	cursor = stringstore_scan(database->store, cursor, 
+		EXPORT_SCAN_BUCKETS, export_entry, &buffer);
+	pthread_mutex_unlock(&database->lock);
+	if (buffer.length >= MAX_FRAME_BYTES || cursor == 0) {
+	    ok = ok && write_chunk(toClient, &buffer);
+	}
+    } while (ok && cursor != 0);
+    // The empty buffer ends the response
+    if (ok) {
+	write_chunk(toClient, &buffer);
+    }
+    trace_mark(TRACE_RESPONDED);
+    free(buffer.data);
+}
+
+/* read_chunk()
+ * −−−−−−−−−−−−−−−
+ * Reads one chunk of a chunked HTTP request body, appending its data to a
+ * byte buffer. Trailers after the last chunk are skipped.
+ *
+ * fromClient: file stream reading from connected client
+ * buffer: the byte buffer
+ *
+ * Returns: size of the chunk, 0 for the last chunk, -1 if the chunk is 
+ *          malformed or too large
+ */
+long read_chunk(FILE* fromClient, ByteBuffer* buffer) {
+    char* line = read_line(fromClient);
+    if (line == NULL) {
+	return -1;
+    }
+    // Chunk extensions after the size are ignored
+    char* end;
+    long size = strtol(line, &end, HEX_BASE);
+    int valid = end != line && size >= 0 && 
+	    size <= MAX_BINARY_REQUEST_BYTES;
+    free(line);
+    if (valid == 0) {
+	return -1;
+    }
+    if (size > 0) {
+	buffer_reserve(buffer, size);
+	if (fread(buffer->data + buffer->length, size, 1, fromClient) != 1) {
+	    return -1;
+	}
+	buffer->length += size;
+    }
+    // Data is followed by CRLF; the last chunk by trailers then CRLF
+    while ((line = read_line(fromClient)) != NULL) {
+	int empty = line[0] == '\0' || strcmp(line, "\r") == 0;
+	free(line);
+	if (empty) {
+	    return size;
+	} else if (size > 0) {
+	    return -1;
+	}
+    }
+    return -1;
+}
+
+/* Key/value pairs read from an import stream, waiting to be added to a 
+ * database. Keys and values are stored NUL terminated in one buffer. */
+typedef struct ImportBatch {
+    ByteBuffer strings;
+    size_t* offsets; // offset of each key; its value follows it
+    int count;
+} ImportBatch;
+
+/* add_import_batch()
+ * −−−−−−−−−−−−−−−
+ * Adds a batch of imported key/value pairs to a database under a single 
+ * lock acquisition, then empties the batch. Each pair is a PUT, replacing
+ * any existing value. The batch is recorded for replicas as one BATCH 
+ * record, so a large import does not push every other change out of the
+ * replication log.
+ *
+ * database: the database
+ * batch: the batch
+ */
+void add_import_batch(Database* database, ImportBatch* batch) {
+    ByteBuffer changes = {NULL, 0, 0, 0};
+    pthread_mutex_lock(&database->lock);
+    // Room is only made for pairs which have arrived, as the count at the
+    // start of the stream comes from the client
+    stringstore_reserve(database->store, 
+	    stringstore_count(database->store) + batch->count);
+    for (int i = 0; i < batch->count; i++) {
+	char* key = batch->strings.data + batch->offsets[i];
+	char* value = key + strlen(key) + 1;
+	uint64_t version = stringstore_add_versioned(database->store, key, 
+		value);
+	if (version == 0) {
+	    continue;
+	}
+	database->putOps++;
+	// Mark cached copies stale, as record_change() does
+	__atomic_add_fetch(&database->epochs[key_stripe(key)], 1, 
+		__ATOMIC_RELEASE);
+	if (database->log != NULL) {
+	    put_change(&changes, CHANGE_PUT, 0, version, database->name, key,
+		    value);
+	}
+    }
+    if (changes.length > 0) {
+	append_record(database->log, CHANGE_BATCH, 0, database->name, NULL,
+		changes.data, changes.length);
+    } else {
+	free(changes.data);
+    }
+    pthread_mutex_unlock(&database->lock);
+    batch->strings.length = 0;
+    batch->count = 0;
+}
+
+/* parse_import_records()
+ * −−−−−−−−−−−−−−−
+ * Moves the complete records at the start of an import stream into a 
+ * batch, adding the batch to the database whenever it is full. Records are
+ * encoded as by export_entry(). Incomplete records are left in the input.
+ *
+ * database: the database
+ * input: the unparsed part of the import stream
+ * batch: the batch
+ * imported: incremented by the number of records parsed
+ *
+ * Returns: 1 if the records were valid, 0 if a record is malformed or 
+ *          larger than MAX_BINARY_REQUEST_BYTES
+ */
+int parse_import_records(Database* database, ByteBuffer* input, 
+	ImportBatch* batch, uint64_t* imported) {
+    size_t position = 0;
+    for (;;) {
+	size_t recordStart = position;
+	uint32_t keyLength, valueLength;
+	if (!read_u32(input->data, &position, input->length, &keyLength) ||
+		!read_u32(input->data, &position, input->length, 
+		&valueLength)) {
+	    position = recordStart;
+	    break;
+	}
+	// Buffered until complete, so records are limited like requests
+	uint64_t recordLength = (uint64_t)keyLength + valueLength;
+	if (recordLength > MAX_BINARY_REQUEST_BYTES) {
+	    return 0;
+	}
+	if (recordLength > input->length - position) {
+	    position = recordStart;
+	    break;
+	}
+	// Keys and values are strings, and keys cannot be empty
+	const char* key = input->data + position;
+	const char* value = key + keyLength;
+	if (keyLength == 0 || memchr(key, '\0', keyLength) != NULL || 
+		memchr(value, '\0', valueLength) != NULL) {
+	    return 0;
+	}
+	// Batches are logged as one record, so are kept well within the log
+	if (batch->count > 0 && 
+		batch->strings.length + recordLength > IMPORT_BATCH_BYTES) {
+	    add_import_batch(database, batch);
+	}
+	batch->offsets[batch->count++] = batch->strings.length;
+	buffer_put(&batch->strings, key, keyLength);
+	buffer_put(&batch->strings, "", 1);
+	buffer_put(&batch->strings, value, valueLength);
+	buffer_put(&batch->strings, "", 1);
+	position += keyLength + valueLength;
+	(*imported)++;
+	if (batch->count == IMPORT_BATCH_RECORDS) {
+	    add_import_batch(database, batch);
+	}
+    }
+    // Keep any partial record for when the rest of it arrives
+    memmove(input->data, input->data + position, input->length - position);
+    input->length -= position;
+    return 1;
+}
+
+/* process_import_request()
+ * −−−−−−−−−−−−−−−
+ * Handles an import request ("PUT /<database>/_import") whose body is a 
+ * stream in the format produced by process_export_request(), sent with 
+ * chunked transfer encoding. Bodies sent with Content-Length are read by 
+ * the HTTP library as strings, so only chunked bodies, which are read here
+ * as they arrive, can carry the binary stream. Pairs are added in batches
+ * of up to IMPORT_BATCH_RECORDS pairs and IMPORT_BATCH_BYTES under one 
+ * lock acquisition each. The count at the start of the stream is not 
+ * relied on. Responds with the number of keys imported, or 400 (Bad 
+ * Request) if the body is not chunked or the stream is malformed or has a
+ * pair over MAX_BINARY_REQUEST_BYTES, in which case the keys before the 
+ * error remain.
+ *
+ * database: the database
+ * headers: the HTTP request headers
+ * fromClient: file stream reading from connected client
+ * toClient: file descriptor writing to connected client
+ */
+void process_import_request(Database* database, HttpHeader** headers, 
+	FILE* fromClient, int toClient) {
+    const char* encoding = find_header(headers, "Transfer-Encoding");
+    if (encoding == NULL || strstr(encoding, "chunked") == NULL) {
+	send_empty_http_response(BAD_STATUS, BAD_EXPLAIN, toClient);
+	return;
+    }
+    ByteBuffer input = {NULL, 0, 0, 0};
+    ImportBatch batch = {{NULL, 0, 0, 0}, 
+	    malloc(sizeof(size_t) * IMPORT_BATCH_RECORDS), 0};
+    uint64_t imported = 0;
+    int started = 0, ok = 1;
+    for (;;) {
+	long chunkSize = read_chunk(fromClient, &input);
+	if (chunkSize < 0) {
+	    ok = 0;
+	    break;
+	}
+	// Skip the number of keys the stream starts with
+	if (started == 0 && input.length >= sizeof(uint64_t)) {
+	    started = 1;
+	    memmove(input.data, input.data + sizeof(uint64_t), 
+		    input.length - sizeof(uint64_t));
+	    input.length -= sizeof(uint64_t);
+	}
+	if (started && parse_import_records(database, &input, &batch, 
+		&imported) == 0) {
+	    ok = 0;
+	    break;
+	}
+	if (chunkSize == 0) {
+	    ok = started && input.length == 0;
+	    break;
+	}
+    }
+    if (batch.count > 0) {
+	add_import_batch(database, &batch);
+    }
+    free(input.data);
+    free(batch.strings.data);
+    free(batch.offsets);
+    if (ok) {
+	char count[INT64_LENGTH];
+	sprintf(count, "%" PRIu64, imported);
+	send_body_http_response(count, toClient);
+    } else {
+	send_empty_http_response(BAD_STATUS, BAD_EXPLAIN, toClient);
+    }
+}
+
+/* process_database_request()
+ * −−−−−−−−−−−−−−−
+ * Finds the database a valid request is for, checks its authorization and
+ * processes the request while holding only that database's lock. GETs of
+ * keys in the thread cache are served without the lock, and imports and 
+ * exports take the lock in batches.
+ * 
+ * databases: the database map
+ * cache: the thread cache
+ * method: the request type
+ * parsedAddress: parsed address URL
+ * headers: the HTTP request headers
+ * body: the HTTP request body
+ * fromClient: file stream reading from connected client
+ * toClient: file descriptor writing to connected client
+ */
+void process_database_request(DatabaseMap* databases, ThreadCache* cache,
+	char* method, char** parsedAddress, HttpHeader** headers, char* body, 
+	FILE* fromClient, int toClient) {
+    // Databases are created by the first PUT to them
+    int create = strcmp(method, "PUT") == 0;
+    if (databases->readOnly && strcmp(method, "GET") != 0) {
+	send_empty_http_response(METHOD_NOT_ALLOWED_STATUS, 
+		METHOD_NOT_ALLOWED_EXPLAIN, toClient);
+	return;
+    }
+    Database* database = get_database(databases, parsedAddress[DATABASE_ARG],
+	    create);
+    if (database == NULL) {
+	if (create) {
+	    send_empty_http_response(UNAVAILABLE_STATUS, 
+		    UNAVAILABLE_EXPLAIN, toClient);
+	} else {
+	    send_empty_http_response(NOT_FOUND_STATUS, 
+		    NOT_FOUND_EXPLAIN, toClient);
+	}
+	return;
+    }
+
+    // Authorization strings are only ever set once (by a replica learning
+    // of a protected database), so an atomic load can be checked unlocked
+    char* authString = __atomic_load_n(&database->authString, 
+	    __ATOMIC_ACQUIRE);
+    int authorized = authString == NULL || 
+	    check_authorization(headers, authString);
+    trace_mark(TRACE_PARSED);
+    if (authorized && strcmp(method, "GET") == 0 && serve_cached_get(cache, 
+	    database, parsedAddress[KEY_ARG], headers, toClient)) {
+	return;
+    }
+    if (authorized && strcmp(method, "GET") == 0 && 
+	    strcmp(parsedAddress[KEY_ARG], EXPORT_KEY) == 0) {
+	process_export_request(database, toClient);
+	return;
+    }
+    if (authorized && strcmp(method, "PUT") == 0 && 
+	    strcmp(parsedAddress[KEY_ARG], IMPORT_KEY) == 0) {
+	process_import_request(database, headers, fromClient, toClient);
+	return;
+    }
+
+    pthread_mutex_lock(&database->lock);
+    trace_mark(TRACE_LOCKED);
+    // Checks if the database requires authorization
+    if (database->authString != NULL && 
+	    check_authorization(headers, database->authString) == 0) {
+	database->authFails++;
+	send_empty_http_response(UNAUTHORIZED_STATUS, 
+		UNAUTHORIZED_EXPLAIN, toClient);
+    } else {
+	char* key = parsedAddress[KEY_ARG]; // Extract key from address
+	process_method(method, database, cache, toClient, key, headers, body);
+    }
+    pthread_mutex_unlock(&database->lock);
+}
+
+/* tracer_init()
+ * −−−−−−−−−−−−−−−
+ * Initialises the registry of trace rings
+ *
+ * sampleRate: one in sampleRate requests is traced, 0 for none
+ * authString: authorization string required to dump traces
+ *
+ * Returns: the initialised tracer
+ */
+Tracer* tracer_init(int sampleRate, char* authString) {
+    Tracer* tracer = malloc(sizeof(Tracer));
+    pthread_mutex_init(&tracer->lock, NULL);
+    tracer->sampleRate = sampleRate;
+    tracer->authString = authString;
+    tracer->rings = NULL;
+    return tracer;
+}
+
+/* acquire_trace_ring()
+ * −−−−−−−−−−−−−−−
+ * Gives a client handling thread a trace ring to record its requests in,
+ * reusing the ring of a finished thread if there is one
+ *
+ * tracer: the tracer
+ *
+ * Returns: the trace ring, NULL if tracing is disabled
+ */
+TraceRing* acquire_trace_ring(Tracer* tracer) {
+    if (tracer->sampleRate == 0) {
+	return NULL;
+    }
+    pthread_mutex_lock(&tracer->lock);
+    TraceRing* ring = tracer->rings;
+    while (ring != NULL && ring->inUse) {
+	ring = ring->next;
+    }
+    if (ring == NULL) {
+	ring = calloc(1, sizeof(TraceRing));
+	pthread_mutex_init(&ring->lock, NULL);
+	ring->next = tracer->rings;
+	tracer->rings = ring;
+    }
+    ring->inUse = 1;
+    pthread_mutex_unlock(&tracer->lock);
+    return ring;
+}
+
+/* release_trace_ring()
+ * −−−−−−−−−−−−−−−
+ * Returns the trace ring of a finishing thread for reuse, keeping the 
+ * traces in it
+ *
+ * tracer: the tracer
+ * ring: the trace ring, NULL if tracing is disabled
+ */
+void release_trace_ring(Tracer* tracer, TraceRing* ring) {
+    if (ring != NULL) {
+	pthread_mutex_lock(&tracer->lock);
+	ring->inUse = 0;
+	pthread_mutex_unlock(&tracer->lock);
+    }
+}
+
+/* start_trace()
+ * −−−−−−−−−−−−−−−
+ * Decides whether to trace a request that has just been read and, if so,
+ * makes it the thread's active trace
+ *
+ * ring: the thread's trace ring, NULL if tracing is disabled
+ * sampleRate: one in sampleRate requests is traced
+ * trace: the trace to record the request in
+ * method: the request type
+ * address: the request address URL
+ *
+ * Returns: 1 if the request is traced, 0 otherwise
+ */
+int start_trace(TraceRing* ring, int sampleRate, RequestTrace* trace, 
+	const char* method, const char* address) {
+    if (ring == NULL || ring->requests++ % sampleRate != 0) {
+	return 0;
+    }
+    memset(trace->marks, 0, sizeof(trace->marks));
+    trace->marks[TRACE_START] = now_ns();
+    snprintf(trace->method, MAX_TRACE_METHOD, "%s", method);
+    snprintf(trace->address, MAX_TRACE_ADDRESS, "%s", address);
+    activeTrace = trace;
+    return 1;
+}
+
+/* finish_trace()
+ * −−−−−−−−−−−−−−−
+ * Ends the thread's active trace and records it in the thread's ring
+ *
+ * ring: the thread's trace ring
+ * trace: the active trace
+ */
+void finish_trace(TraceRing* ring, RequestTrace* trace) {
+    trace->marks[TRACE_END] = now_ns();
+    activeTrace = NULL;
+    pthread_mutex_lock(&ring->lock);
+    ring->records[ring->count++ % TRACE_RING_SIZE] = *trace;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* trace_span()
+ * −−−−−−−−−−−−−−−
+ * Computes how long a traced request spent in a phase
+ *
+ * trace: the trace
+ * mark: the mark ending the phase
+ *
+ * Returns: nanoseconds from the previous mark reached to the given mark, 
+ *          0 if the request skipped the phase
+ */
+uint64_t trace_span(const RequestTrace* trace, int mark) {
+    if (trace->marks[mark] == 0) {
+	return 0;
+    }
+    int previous = mark - 1;
+    while (trace->marks[previous] == 0) {
+	previous--;
+    }
+    return trace->marks[mark] - trace->marks[previous];
+}
+
+/* compare_traces()
+ * −−−−−−−−−−−−−−−
+ * Orders traces from slowest to fastest, for qsort()
+ *
+ * first: the first trace
+ * second: the second trace
+ *
+ * Returns: negative if first is slower, positive if second is slower
+ */
+int compare_traces(const void* first, const void* second) {
+    const RequestTrace* a = first;
+    const RequestTrace* b = second;
+    uint64_t aTotal = a->marks[TRACE_END] - a->marks[TRACE_START];
+    uint64_t bTotal = b->marks[TRACE_END] - b->marks[TRACE_START];
+    return (aTotal < bTotal) - (aTotal > bTotal);
+}
+
+/* format_traces()
+ * −−−−−−−−−−−−−−−
+ * Formats the slowest of the requests in every trace ring as a table of 
+ * the microseconds spent in each phase: parse (address parsing, 
+ * validation and database lookup), lock (waiting for the database lock), 
+ * store (the store operation), respond (building and writing the 
+ * response) and other (releasing the lock and freeing the request).
+ *
+ * tracer: the tracer
+ * count: maximum number of requests to include
+ *
+ * Returns: the formatted table, to be freed by the caller
+ */
+char* format_traces(Tracer* tracer, int count) {
+    // Copy every ring so no ring lock is held while sorting
+    size_t total = 0, capacity = 0;
+    RequestTrace* traces = NULL;
+    pthread_mutex_lock(&tracer->lock);
+    for (TraceRing* ring = tracer->rings; ring != NULL; ring = ring->next) {
+	pthread_mutex_lock(&ring->lock);
+	size_t recorded = ring->count < TRACE_RING_SIZE ? ring->count : 
+		TRACE_RING_SIZE;
+	if (total + recorded > capacity) {
+	    capacity = (total + recorded) * 2;
+	    traces = realloc(traces, sizeof(RequestTrace) * capacity);
+	}
+	memcpy(traces + total, ring->records, sizeof(RequestTrace) * recorded);
+	total += recorded;
+	pthread_mutex_unlock(&ring->lock);
+    }
+    pthread_mutex_unlock(&tracer->lock);
+    qsort(traces, total, sizeof(RequestTrace), compare_traces);
+
+    char* table;
+    size_t length;
+    FILE* output = open_memstream(&table, &length);
+    fprintf(output, "Slowest %zu of %zu recent traced requests "
+	    "(microseconds)\n", (size_t)count < total ? (size_t)count : total,
+	    total);
+    fprintf(output, "%10s %9s %9s %9s %9s %9s  request\n", "total", "parse",
+	    "lock", "store", "respond", "other");
+    for (size_t i = 0; i < total && i < (size_t)count; i++) {
+	RequestTrace* trace = &traces[i];
+	fprintf(output, "%10.1f", (double)(trace->marks[TRACE_END] - 
+		trace->marks[TRACE_START]) / NS_PER_US);
+	for (int mark = TRACE_PARSED; mark <= TRACE_END; mark++) {
+	    fprintf(output, " %9.1f", (double)trace_span(trace, mark) / 
+		    NS_PER_US);
+	}
+	fprintf(output, "  %s %s\n", trace->method, trace->address);
+    }
+    fclose(output);
+    free(traces);
+    return table;
+}
+
+/* send_trace_response()
+ * −−−−−−−−−−−−−−−
+ * Handles a trace request ("GET /_trace?n=N") by sending the table of the
+ * N slowest traced requests. As traces reveal the keys of every database, 
+ * the server's authorization string is required.
+ *
+ * tracer: the tracer
+ * address: the request address URL
+ * headers: the HTTP request headers
+ * toClient: file descriptor writing to connected client
+ */
+void send_trace_response(Tracer* tracer, char* address, HttpHeader** headers,
+	int toClient) {
+    if (tracer->sampleRate == 0) {
+	send_empty_http_response(NOT_FOUND_STATUS, NOT_FOUND_EXPLAIN, 
+		toClient);
+	return;
+    }
+    if (check_authorization(headers, tracer->authString) == 0) {
+	send_empty_http_response(UNAUTHORIZED_STATUS, UNAUTHORIZED_EXPLAIN, 
+		toClient);
+	return;
+    }
+    int count = DEFAULT_TRACE_COUNT;
+    char* countParameter = strstr(address, TRACE_COUNT_PARAMETER);
+    if (countParameter != NULL) {
+	count = atoi(countParameter + strlen(TRACE_COUNT_PARAMETER));
+    }
+    if (count < 0) {
+	count = 0;
+    }
+    char* table = format_traces(tracer, count);
+    send_body_http_response(table, toClient);
+    free(table);
+}
+
+/* serve_client()
+ * −−−−−−−−−−−−−−−
+ * Processes and handles HTTP requests from a single client until it 
+ * disconnects or times out. Sends HTTP responses based on the operation.
+ *
+ * arguments: arguments passed to the client handling thread
+ * toClient: the client socket
+ */
+void serve_client(ThreadParameters* arguments, int toClient) {
+    // Set up file descriptors, streams, and variables to be used
+    int clientReadEnd = dup(toClient);
+    FILE* fromClient = fdopen(clientReadEnd, "r");
+    char* method, *address, *body;
+    HttpHeader** headers;
+    track_client(arguments->admission, toClient);
+    // Repeatedly read requests from client until EOF
+    while (get_HTTP_request(fromClient, &method, &address, 
+	    &headers, &body) == 1) {
+	// Replication requests take over the connection. As the snapshot
+	// holds every database, the server's authorization is required.
+	if (strcmp(method, "GET") == 0 && 
+		matches_address(address, REPLICATE_ADDRESS)) {
+	    int authorized = check_authorization(headers, 
+		    arguments->authString);
+	    if (authorized) {
+		start_stream(arguments, address, toClient);
+	    } else {
+		send_empty_http_response(UNAUTHORIZED_STATUS, 
+			UNAUTHORIZED_EXPLAIN, toClient);
+	    }
+	    free_request(method, address, headers, body);
+	    if (authorized) {
+		break;
+	    }
+	    continue;
+	}
+	if (strcmp(method, "GET") == 0 && 
+		matches_address(address, TRACE_ADDRESS)) {
+	    send_trace_response(arguments->tracer, address, headers, 
+		    toClient);
+	    free_request(method, address, headers, body);
+	    continue;
+	}
+	RequestTrace trace;
+	int traced = start_trace(arguments->traces, 
+		arguments->tracer->sampleRate, &trace, method, address);
+	// Check if given request is well-formed AND valid
+	char** parsedAddress = split_by_char(address, '/', MAX_URL_LENGTH); 
+	if (check_valid_request(method, parsedAddress, headers, body)) {
+	    process_database_request(arguments->databases, arguments->cache,
+		    method, parsedAddress, headers, body, fromClient, 
+		    toClient);
+	} else {
+	    // Sends ahttp request if request is not well-formed
+	    send_empty_http_response(BAD_STATUS, BAD_EXPLAIN, toClient);
+    	}
+	free(parsedAddress);
+	free_request(method, address, headers, body);
+	if (traced) {
+	    finish_trace(arguments->traces, &trace);
+	}
+    }
+    untrack_client(arguments->admission, toClient);
+    disconnect_client(arguments->stats, toClient, fromClient);
+}
+
+/* handle_client()
+ * −−−−−−−−−−−−−−−
+ * Serves the client the thread was created for, then keeps serving
+ * clients waiting for a connection slot until none are left.
+ *
+ * arg: arguments passed to thread
+ */
+void* handle_client(void* arg) {
+    ThreadParameters* arguments = (ThreadParameters*)arg;
+    int client = arguments->client;
+    int binary = arguments->binary;
+    arguments->cache = acquire_thread_cache(arguments->databases);
+    arguments->traces = acquire_trace_ring(arguments->tracer);
+    while (client != -1) {
+	if (binary) {
+	    serve_binary_client(arguments, client);
+	} else {
+	    serve_client(arguments, client);
+	}
+	client = next_pending_client(arguments->admission, arguments->stats,
+		&binary);
+    }
+    release_thread_cache(arguments->databases, arguments->cache);
+    release_trace_ring(arguments->tracer, arguments->traces);
+    free(arg);
+    return NULL;
+}
+
+/* print_database_stats()
+ * −−−−−−−−−−−−−−−
+ * Prints the operation statistics totalled over all databases, followed by
+ * the statistics of each database
+ *
+ * databases: the database map
+ */
+void print_database_stats(DatabaseMap* databases) {
+    int authFails = 0, getOps = 0, putOps = 0, deleteOps = 0, postOps = 0;
+    // GETs served from thread caches count as GET operations
+    unsigned int hits[MAX_DATABASES];
+    count_cache_hits(databases, hits);
+    pthread_rwlock_rdlock(&databases->lock);
+    for (int i = 0; i < DATABASE_BUCKETS; i++) {
+	for (Database* database = databases->buckets[i]; database != NULL;
+		database = database->next) {
+	    pthread_mutex_lock(&database->lock);
+	    authFails += database->authFails;
+	    getOps += database->getOps + hits[database->id];
+	    putOps += database->putOps;
+	    deleteOps += database->deleteOps;
+	    postOps += database->postOps;
+	    pthread_mutex_unlock(&database->lock);
+	}
+    }
+    fprintf(stderr, "Auth failures:%d\n"
+	    "GET operations:%d\n"
+	    "PUT operations:%d\n"
+	    "DELETE operations:%d\n"
+	    "POST operations:%d\n", authFails, getOps, putOps, deleteOps, 
+	    postOps);
+    for (int i = 0; i < DATABASE_BUCKETS; i++) {
+	for (Database* database = databases->buckets[i]; database != NULL;
+		database = database->next) {
+	    pthread_mutex_lock(&database->lock);
+	    fprintf(stderr, "Database %s:GET %d PUT %d DELETE %d POST %d "
+		    "auth failures %d\n", database->name, 
+		    database->getOps + hits[database->id], database->putOps, 
+		    database->deleteOps, database->postOps,
+		    database->authFails);
+	    pthread_mutex_unlock(&database->lock);
+	}
+    }
+    pthread_rwlock_unlock(&databases->lock);
+}
+
+/* print_stats()
+ * −−−−−−−−−−−−−−−
+ * Prints the server statistics
+ *
+ * stats: the server statistics
+ * databases: the database map
+ */
+void print_stats(ServerStats* stats, DatabaseMap* databases) {
+    pthread_mutex_lock(&stats->lock);
+    fprintf(stderr, "Connected clients:%d\n"
+	    "Completed clients:%d\n", stats->connected, stats->completed);
+    pthread_mutex_unlock(&stats->lock);
+    print_database_stats(databases);
+    pthread_mutex_lock(&stats->lock);
+    fprintf(stderr, "Queued clients:%d\n"
+	    "Rejected clients:%d\n"
+	    "Timed out clients:%d\n"
+	    "Total queue wait (ms):%ld\n"
+	    "Max queue wait (ms):%ld\n", stats->queued, stats->rejected, 
+	    stats->timeouts, stats->queueWaitTotalMs, stats->queueWaitMaxMs);
+    pthread_mutex_unlock(&stats->lock);
+    fflush(stderr);
+}
+
+/* handle_sig()
+ * −−−−−−−−−−−−−−−
+ * Handles signals. Prints the server statistics on SIGHUP, prints the 
+ * slowest traced requests on SIGUSR1, and tells the accepting thread to 
+ * shut down on SIGTERM.
+ *
+ * args: arguments passed to thread
+ */
+void* handle_sig(void* args) {
+    SigParameters arguments = *(SigParameters*)args;
+    sigset_t set = arguments.set;
+    ServerStats* stats = arguments.stats;
+    DatabaseMap* databases = arguments.databases;
+    free(args);
+    int sig;
+
+    // Repeatedly wait until SIGHUP, SIGUSR1 or SIGTERM is detected
+    while (1) {
+    	sigwait(&set, &sig);
+	if (sig == SIGHUP) {
+	    print_stats(stats, databases);
+	} else if (sig == SIGUSR1) {
+	    char* table = format_traces(arguments.tracer, DEFAULT_TRACE_COUNT);
+	    fputs(table, stderr);
+	    fflush(stderr);
+	    free(table);
+	} else if (sig == SIGTERM) {
+	    char wake = 0;
+	    write(arguments.shutdownPipe, &wake, sizeof(wake));
+	}
+    }
+}
+
+/* block_signals()
+ * −−−−−−−−−−−−−−−
+ * Blocks the signals the server handles on a dedicated thread. Must be 
+ * called before any other thread is created, so that every thread 
+ * inherits the mask and none can be killed by them.
+ *
+ * Returns: the set of blocked signals
+ */
+sigset_t block_signals(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGPIPE);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
     pthread_sigmask(SIG_BLOCK, &set, NULL);
+    return set;
+}
+
+/* process_connections()
+ * −−−−−−−−−−−−−−−
+ * Processes connections and creates threads to handle them. Connections 
+ * over the limit wait for a free slot, or are rejected without blocking
+ * once the pending queue is full. Stops accepting connections on SIGTERM
+ * or when a new server connects to take over, then drains the clients
+ * being served.
+ *
+ * serverSocket: the file descriptor socket for communication to server
+ * binarySocket: the socket for binary protocol clients, -1 if disabled
+ * handoverSocket: the socket new servers connect to to take over, -1 if 
+ *                 disabled
+ * stats: the server statistics
+ * databases: the database map
+ * serverDetails: command line arguments when creating dbserver 
+ * set: the signals blocked by block_signals(), handled by a thread
+ *
+ * Returns: the connection to the server taking over, -1 on SIGTERM
+ */
+int process_connections(int serverSocket, int binarySocket, 
+	int handoverSocket, ServerStats* stats, DatabaseMap* databases, 
+	ServerParameters serverDetails, sigset_t set) {
+    Admission* admission = admission_init(serverDetails.connections);
+    Tracer* tracer = tracer_init(serverDetails.traceRate, 
+	    serverDetails.authString);
+    struct sockaddr_in fromAddr;
+    socklen_t fromAddrSize; 
+    pthread_t thread;
+    int shutdownPipe[2];
+    pipe(shutdownPipe);
     // Set up arguments in struct to be passsed onto signal handling thread
     SigParameters* sigArgs = (SigParameters*)malloc(sizeof(SigParameters));
     sigArgs->set = set;
     sigArgs->stats = stats;
+    sigArgs->databases = databases;
+    sigArgs->tracer = tracer;
+    sigArgs->shutdownPipe = shutdownPipe[1];
     pthread_create(&thread, NULL, &handle_sig, sigArgs);
     int newClient;
-    // Keep accepting new connections
+    // Wait for a shutdown, and on the HTTP socket and, if enabled, the 
+    // binary protocol and handover sockets (negative descriptors are 
+    // ignored by poll)
+    struct pollfd listeners[POLL_COUNT];
+    listeners[POLL_SHUTDOWN].fd = shutdownPipe[0];
+    listeners[POLL_HTTP].fd = serverSocket;
+    listeners[POLL_BINARY].fd = binarySocket;
+    listeners[POLL_HANDOVER].fd = handoverSocket;
+    for (int i = 0; i < POLL_COUNT; i++) {
+	listeners[i].events = POLLIN;
+    }
+    int binary = 0;
+    int handoverClient = -1;
+    // Keep accepting new connections until shut down
     while (1) {
+	if (poll(listeners, POLL_COUNT, -1) <= 0) {
+	    continue;
+	}
+	if (listeners[POLL_SHUTDOWN].revents & POLLIN) {
+	    break;
+	}
+	if (listeners[POLL_HANDOVER].revents & POLLIN) {
+	    handoverClient = accept(handoverSocket, NULL, NULL);
+	    if (handoverClient >= 0) {
+		break;
+	    }
+	    continue;
+	}
+	// Alternate between sockets when both are ready
+	binary = (listeners[POLL_BINARY].revents & POLLIN) && (binary == 0 || 
+		(listeners[POLL_HTTP].revents & POLLIN) == 0);
 	fromAddrSize = sizeof(struct sockaddr_in);
-	newClient = accept(serverSocket, (struct sockaddr*)&fromAddr, 
-		&fromAddrSize);
-	// Check if the number of current connections has exceeded the limit
-    	if (((stats->connected + 1) > serverDetails.connections) 
-		&& serverDetails.connections != 0) {
-	    send_empty_http_response(UNAVAILABLE_STATUS, 
-		    UNAVAILABLE_EXPLAIN, newClient);
-	    close(newClient);
-	} else {
-	    stats->connected++;
+	newClient = accept(binary ? binarySocket : serverSocket, 
+		(struct sockaddr*)&fromAddr, &fromAddrSize);
+	if (newClient < 0) {
+	    continue;
+	}
+	set_client_timeouts(newClient);
+	// Only start a thread if the client was given a connection slot
+	AdmitResult result = admit_client(admission, stats, newClient, 
+		binary);
+	if (result == ADMIT_REJECT) {
+	    reject_client(admission, stats, newClient, binary);
 	} 
+	if (result != ADMIT_RUN) {
+	    continue;
+	}
 	// Set up arguments in struct to be passed onto client handling thread
 	ThreadParameters* args = 
 		(ThreadParameters*) malloc(sizeof(ThreadParameters));
 	args->client = newClient;
-	args->public = publicStore;
-	args->private = privateStore;
-	args->authString = serverDetails.authString;
+	args->binary = binary;
+	args->databases = databases;
 	args->stats = stats;
-	args->lock = lock;
+	args->admission = admission;
+	args->tracer = tracer;
+	args->authString = serverDetails.authString;
 	// Create thread to handle accepted connections
 	pthread_t threadId;
 	pthread_create(&threadId, NULL, handle_client, args);
 	pthread_detach(threadId);
     }
+    // Connections keep queueing on the listening sockets while draining, 
+    // for the server taking over to accept
+    drain_clients(admission, databases->log);
+    return handoverClient;
+}
+
+/* setup_handover_listen()
+ * −−−−−−−−−−−−−−−
+ * Sets up the unix domain socket a new server connects to in order to take
+ * over from this one, replacing any left by a previous server.
+ *
+ * path: path of the socket
+ *
+ * Returns: the listening socket
+ *          Exit code 3 if the socket is unable to listen
+ */
+int setup_handover_listen(char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    int handoverSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (bind(handoverSocket, (struct sockaddr*)&address, 
+	    sizeof(struct sockaddr_un)) || listen(handoverSocket, 1)) {
+    	fprintf(stderr, "dbserver: unable to open socket for listening\n");
+	exit(EXIT_SOCKET_ERROR);
+    }
+    return handoverSocket;
+}
+
+/* send_listeners()
+ * −−−−−−−−−−−−−−−
+ * Passes the listening sockets to the server taking over, as SCM_RIGHTS
+ * ancillary data attached to a single byte holding the number of sockets
+ *
+ * toServer: the connection to the server taking over
+ * sockets: the HTTP socket followed by the binary protocol socket, if any
+ * count: number of sockets
+ *
+ * Returns: 1 if the sockets were sent, 0 on error
+ */
+int send_listeners(int toServer, int* sockets, int count) {
+    char socketCount = count;
+    struct iovec data = {&socketCount, sizeof(socketCount)};
+    union {
+	char buffer[CMSG_SPACE(sizeof(int) * MAX_HANDOVER_SOCKETS)];
+	struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr message;
+    memset(&message, 0, sizeof(struct msghdr));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(header), sockets, sizeof(int) * count);
+    return sendmsg(toServer, &message, 0) == sizeof(socketCount);
+}
+
+/* hand_over()
+ * −−−−−−−−−−−−−−−
+ * Hands over to a new server once clients have drained: the listening
+ * sockets are passed to it, followed by a snapshot of every database in
+ * the replication frame format.
+ *
+ * databases: the database map
+ * toServer: the connection to the server taking over
+ * serverSocket: the HTTP listening socket
+ * binarySocket: the binary protocol listening socket, -1 if disabled
+ *
+ * Returns: Exit code 5 if the handover failed
+ */
+void hand_over(DatabaseMap* databases, int toServer, int serverSocket, 
+	int binarySocket) {
+    int sockets[MAX_HANDOVER_SOCKETS] = {serverSocket, binarySocket};
+    uint64_t offset;
+    if (send_listeners(toServer, sockets, binarySocket < 0 ? 1 : 2) == 0 ||
+	    send_snapshot(databases, toServer, &offset) == 0) {
+	fprintf(stderr, "dbserver: unable to hand over to new server\n");
+	exit(EXIT_HANDOVER_ERROR);
+    }
+    close(toServer);
+}
+
+/* receive_listeners()
+ * −−−−−−−−−−−−−−−
+ * Receives the listening sockets passed by send_listeners()
+ *
+ * fromServer: the connection to the server being taken over from
+ * sockets: set to the HTTP socket followed by the binary protocol socket
+ *
+ * Returns: number of sockets received, 0 on error
+ */
+int receive_listeners(int fromServer, int* sockets) {
+    char socketCount = 0;
+    struct iovec data = {&socketCount, sizeof(socketCount)};
+    union {
+	char buffer[CMSG_SPACE(sizeof(int) * MAX_HANDOVER_SOCKETS)];
+	struct cmsghdr align;
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof(struct msghdr));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    if (recvmsg(fromServer, &message, 0) != sizeof(socketCount)) {
+	return 0;
+    }
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (header == NULL || header->cmsg_type != SCM_RIGHTS || 
+	    socketCount < 1 || socketCount > MAX_HANDOVER_SOCKETS ||
+	    header->cmsg_len != CMSG_LEN(sizeof(int) * socketCount)) {
+	return 0;
+    }
+    memcpy(sockets, CMSG_DATA(header), sizeof(int) * socketCount);
+    return socketCount;
+}
+
+/* read_snapshot()
+ * −−−−−−−−−−−−−−−
+ * Reads and applies a snapshot sent by send_snapshot(). Must be called 
+ * before the replication log is attached, so the snapshot is not logged.
+ *
+ * databases: the database map
+ * from: the stream to read the snapshot from
+ *
+ * Returns: 1 if the whole snapshot was read, 0 otherwise
+ */
+int read_snapshot(DatabaseMap* databases, FILE* from) {
+    // The snapshot ends with SNAPSHOT_END, which sets the log id
+    ReplicaParameters snapshot = {NULL, NULL, databases, 0, NULL, "", NULL};
+    ByteBuffer frame = {NULL, 0, 0, 0};
+    apply_frames(&snapshot, from, &frame);
+    finish_snapshot(databases, 0);
+    free(frame.data);
+    int complete = snapshot.logId != NULL;
+    free(snapshot.logId);
+    return complete;
+}
+
+/* take_over()
+ * −−−−−−−−−−−−−−−
+ * Takes over from a server listening for a handover at the given path, 
+ * if there is one. The old server stops accepting connections and drains
+ * its clients, then passes its listening sockets and a snapshot of its 
+ * databases, so this server starts with every key and without refusing 
+ * any connection. Must be called before the replication log is attached,
+ * so the snapshot is not logged.
+ *
+ * databases: the database map
+ * path: path of the handover socket
+ * serverSocket: set to the HTTP listening socket taken over
+ * binarySocket: set to the binary protocol listening socket taken over, 
+ *               -1 if the old server had none
+ *
+ * Returns: 1 if this server took over, 0 if there was no server to take 
+ *          over from,
+ *          Exit code 5 if the handover failed
+ */
+int take_over(DatabaseMap* databases, char* path, int* serverSocket, 
+	int* binarySocket) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    int fromServer = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fromServer, (struct sockaddr*)&address, 
+	    sizeof(struct sockaddr_un))) {
+	close(fromServer);
+	return 0;
+    }
+    int sockets[MAX_HANDOVER_SOCKETS] = {-1, -1};
+    int count = receive_listeners(fromServer, sockets);
+    FILE* fromOldServer = fdopen(fromServer, "r");
+    int complete = count > 0 && read_snapshot(databases, fromOldServer);
+    fclose(fromOldServer);
+    if (complete == 0) {
+	fprintf(stderr, "dbserver: unable to take over from old server\n");
+	exit(EXIT_HANDOVER_ERROR);
+    }
+    *serverSocket = sockets[0];
+    *binarySocket = sockets[1];
+    return 1;
+}
+
+/* save_snapshot()
+ * −−−−−−−−−−−−−−−
+ * Saves a snapshot of every database to a file, for load_snapshot() to 
+ * restore when the server next starts. The snapshot is written to a 
+ * temporary file which then replaces the file, so a failed save leaves the
+ * previous snapshot intact. As the snapshot holds every database and their
+ * authorization strings, only the owner may read it.
+ *
+ * databases: the database map
+ * path: path of the snapshot file
+ *
+ * Returns: Exit code 6 if the snapshot could not be saved
+ */
+void save_snapshot(DatabaseMap* databases, char* path) {
+    char* tempPath = malloc(strlen(path) + strlen(SNAPSHOT_TEMP_SUFFIX) + 1);
+    sprintf(tempPath, "%s" SNAPSHOT_TEMP_SUFFIX, path);
+    int file = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, SNAPSHOT_MODE);
+    uint64_t offset;
+    int saved = file >= 0 && send_snapshot(databases, file, &offset) && 
+	    fsync(file) == 0;
+    if (file >= 0 && close(file)) {
+	saved = 0;
+    }
+    if (saved == 0 || rename(tempPath, path)) {
+	fprintf(stderr, "dbserver: unable to save snapshot\n");
+	unlink(tempPath);
+	exit(EXIT_SNAPSHOT_ERROR);
+    }
+    free(tempPath);
+}
+
+/* load_snapshot()
+ * −−−−−−−−−−−−−−−
+ * Restores the databases from the snapshot saved by save_snapshot(), if 
+ * there is one. Must be called before the replication log is attached.
+ *
+ * databases: the database map
+ * path: path of the snapshot file
+ *
+ * Returns: Exit code 6 if the snapshot could not be read
+ */
+void load_snapshot(DatabaseMap* databases, char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL && errno == ENOENT) {
+	return;
+    }
+    int complete = file != NULL && read_snapshot(databases, file);
+    if (file != NULL) {
+	fclose(file);
+    }
+    if (complete == 0) {
+	fprintf(stderr, "dbserver: unable to load snapshot\n");
+	exit(EXIT_SNAPSHOT_ERROR);
+    }
 }
 
 /* print_port()
@@ -602,27 +4239,78 @@ ServerStats* server_stats_init(void) {
     ServerStats* newStats = malloc(sizeof(ServerStats));
     newStats->connected = 0;
     newStats->completed = 0;
-    newStats->authFails = 0;
-    newStats->getOps = 0;
-    newStats->putOps = 0;
-    newStats->deleteOps = 0;
+    newStats->queued = 0;
+    newStats->rejected = 0;
+    newStats->timeouts = 0;
+    newStats->queueWaitTotalMs = 0;
+    newStats->queueWaitMaxMs = 0;
+    pthread_mutex_init(&newStats->lock, NULL);
     return newStats;
 }
 
 int main(int argc, char** argv) {
+    // Signals are handled by a thread started once connections are 
+    // accepted, so are blocked before any thread (such as a replica's) exists
+    sigset_t set = block_signals();
     ServerStats* stats = server_stats_init();
-    // Creates public and private instances of StringStore
-    struct StringStore* publicStore = stringstore_init();
-    struct StringStore* privateStore = stringstore_init();
-
     // Sets up connections based on command line arguments
     ServerParameters serverDetails = process_command_arguments(argc, argv);
-    int serverSocket = setup_listen(serverDetails.portnum, 
-	    serverDetails.connections);
+
+    // Creates the public and private databases, then any declared ones
+    DatabaseMap* databases = database_map_init();
+    declare_database(databases, PUBLIC_DATABASE, NULL);
+    declare_database(databases, PRIVATE_DATABASE, serverDetails.authString);
+    if (serverDetails.databaseFile != NULL) {
+	load_database_file(databases, serverDetails.databaseFile);
+    }
+    // Takes the listening sockets and data of any server being replaced,
+    // otherwise restores the data saved at the last shutdown
+    int serverSocket = -1, binarySocket = -1, tookOver = 0;
+    if (serverDetails.handoverPath != NULL) {
+	tookOver = take_over(databases, serverDetails.handoverPath, 
+		&serverSocket, &binarySocket);
+    }
+    if (tookOver == 0 && serverDetails.snapshotPath != NULL) {
+	load_snapshot(databases, serverDetails.snapshotPath);
+    }
+    if (serverDetails.replicaOf == NULL) {
+	attach_replication_log(databases, replication_log_init());
+    } else {
+	start_replica(databases, serverDetails.replicaOf, 
+		serverDetails.authString);
+    }
+    if (serverSocket < 0) {
+	serverSocket = setup_listen(serverDetails.portnum, 
+		serverDetails.connections);
+    }
     print_port(serverSocket);
-    // Processes connections 
-    process_connections(serverSocket, stats, publicStore, privateStore, 
-	    serverDetails);
+    if (serverDetails.binaryPort != NULL) {
+	if (binarySocket < 0) {
+	    binarySocket = setup_listen(serverDetails.binaryPort, 
+		    serverDetails.connections);
+	}
+	print_port(binarySocket);
+    } else if (binarySocket >= 0) {
+	close(binarySocket);
+	binarySocket = -1;
+    }
+    int handoverSocket = -1;
+    if (serverDetails.handoverPath != NULL) {
+	handoverSocket = setup_handover_listen(serverDetails.handoverPath);
+    }
+    // Processes connections until shut down or taken over
+    int handoverClient = process_connections(serverSocket, binarySocket, 
+	    handoverSocket, stats, databases, serverDetails, set);
+    if (handoverClient >= 0) {
+	hand_over(databases, handoverClient, serverSocket, binarySocket);
+    } else {
+	if (serverDetails.handoverPath != NULL) {
+	    unlink(serverDetails.handoverPath);
+	}
+	if (serverDetails.snapshotPath != NULL) {
+	    save_snapshot(databases, serverDetails.snapshotPath);
+	}
+    }
+    print_stats(stats, databases);
     return(EXIT_SUCCESS);
 }
-    
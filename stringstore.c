@@ -1,95 +1,313 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
 #include <stringstore.h>
 
-/* A database to store keys and its respective value */
-struct StringStore { 
-    const char* key;
+/* Longest decimal representation of an int64_t, including sign and NUL */
+#define INT64_DIGITS 21
+/* log2 of the number of buckets in a new store */
+#define INITIAL_BUCKET_BITS 4
+#define HASH_BITS 64
+/* How many buckets ahead of the one being visited scans prefetch */
+#define SCAN_PREFETCH_DISTANCE 8
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/* A key and its value. Each entry records the version it was last written
+ * at. The key is stored in the entry itself, as it never changes. */
+typedef struct Entry {
     const char* value;
-    struct StringStore* nextEntry;
+    uint64_t version;
+    struct Entry* nextEntry; // next entry in the same bucket
+    char key[];
+} Entry;
+
+/* A database to store keys and their respective values, as a hash table
+ * of chained entries. Keys are placed in buckets by the high bits of their
+ * hash, so when the table doubles the entries of bucket i move to buckets
+ * 2i and 2i + 1, keeping their order. The table doubles whenever it holds
+ * more entries than buckets, and never shrinks. The store holds the latest
+ * version it has issued, so versions are never reused for a key. */
+struct StringStore {
+    Entry** buckets;
+    int bucketBits; // log2 of the number of buckets
+    size_t count;
+    uint64_t version;
 };
 
+/* Returns the FNV-1a hash of the key */
+static uint64_t hash_key(const char* key) {
+    uint64_t hash = FNV_OFFSET;
+    for (int i = 0; key[i] != '\0'; i++) {
+	hash ^= (unsigned char)key[i];
+	hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Returns the index of the bucket for a hash in a table of 2^bucketBits
+ * buckets */
+static size_t bucket_index(uint64_t hash, int bucketBits) {
+    return hash >> (HASH_BITS - bucketBits);
+}
+
+/* Returns the bucket holding the key, if it is in the store */
+static Entry** find_bucket(StringStore* store, const char* key) {
+    return &store->buckets[bucket_index(hash_key(key), store->bucketBits)];
+}
+
+/* Returns the entry for the given key, NULL if there is none */
+static Entry* find_entry(StringStore* store, const char* key) {
+    Entry* entry = *find_bucket(store, key);
+    while (entry != NULL && strcmp(entry->key, key) != 0) {
+	entry = entry->nextEntry;
+    }
+    return entry;
+}
+
+/* Moves every entry into a table of 2^bucketBits buckets. Returns 1 on 
+ * success, 0 on failure. */
+static int resize(StringStore* store, int bucketBits) {
+    Entry** buckets = calloc((size_t)1 << bucketBits, sizeof(Entry*));
+    if (buckets == NULL) {
+	return 0;
+    }
+    for (size_t i = 0; i < (size_t)1 << store->bucketBits; i++) {
+	Entry* entry = store->buckets[i];
+	while (entry != NULL) {
+	    Entry* next = entry->nextEntry;
+	    Entry** bucket = 
+		    &buckets[bucket_index(hash_key(entry->key), bucketBits)];
+	    entry->nextEntry = *bucket;
+	    *bucket = entry;
+	    entry = next;
+	}
+    }
+    free(store->buckets);
+    store->buckets = buckets;
+    store->bucketBits = bucketBits;
+    return 1;
+}
+
 StringStore* stringstore_init(void) {
-    StringStore* firstEntry = malloc(sizeof(StringStore));
-    firstEntry->key = NULL;
-    firstEntry->value = NULL;
-    firstEntry->nextEntry = NULL;
-    return firstEntry;
+    StringStore* store = malloc(sizeof(StringStore));
+    store->buckets = calloc((size_t)1 << INITIAL_BUCKET_BITS, sizeof(Entry*));
+    store->bucketBits = INITIAL_BUCKET_BITS;
+    store->count = 0;
+    store->version = 0;
+    return store;
 }
 
 StringStore* stringstore_free(StringStore* store) {
-    StringStore* currentEntry;
-    while(store != NULL) {
-	currentEntry = store;
-	store = store->nextEntry;
-	free((char*)(currentEntry->key));
-	free((char*)(currentEntry->value));
-	free(currentEntry);
+    for (size_t i = 0; i < (size_t)1 << store->bucketBits; i++) {
+	Entry* entry = store->buckets[i];
+	while (entry != NULL) {
+	    Entry* next = entry->nextEntry;
+	    free((char*)(entry->value));
+	    free(entry);
+	    entry = next;
+	}
     }
-    return store;
+    free(store->buckets);
+    free(store);
+    return NULL;
 }
 
-int stringstore_add(StringStore* store, const char* key, const char* value) {
-    StringStore* currentEntry;
-    char* newKey = strdup(key);
+int stringstore_reserve(StringStore* store, size_t count) {
+    int bucketBits = store->bucketBits;
+    while (((size_t)1 << bucketBits) < count && bucketBits < HASH_BITS - 1) {
+	bucketBits++;
+    }
+    return bucketBits == store->bucketBits || resize(store, bucketBits);
+}
+
+size_t stringstore_count(StringStore* store) {
+    return store->count;
+}
+
+/* Stores a copy of the key and value at the given version. Returns 1 on 
+ * success, 0 on failure. */
+static int put_entry(StringStore* store, const char* key, const char* value,
+	uint64_t version) {
     char* newValue = strdup(value);
-    if (newKey == NULL || newValue == NULL) {
+    if (newValue == NULL) {
 	return 0;
-    } else {
-	for (;;) {
-	    currentEntry = store;
-	    store = store->nextEntry;
-    	    if (store == NULL) {
-    		// Populate the next entry
-    		StringStore* newEntry = malloc(sizeof(StringStore));
-    		newEntry->key = newKey;
-    		newEntry->value = newValue;
-    		newEntry->nextEntry = NULL;
-    		// Link the new entry to the previous
-    		currentEntry->nextEntry = newEntry;
-    		return 1;
-	    // Overwrite value if given key exist already
-    	    } else if (strcmp(store->key, newKey) == 0) {
-		free(newKey);
-    		free((char*)(store->value));
-    		store->value = newValue;
-		return 1;
-    	    }
-	}
-    }    
+    }
+    // Overwrite value if given key exist already
+    Entry* entry = find_entry(store, key);
+    if (entry != NULL) {
+	free((char*)(entry->value));
+	entry->value = newValue;
+	entry->version = version;
+	return 1;
+    }
+    // Grow before adding so the new entry goes in its final bucket
+    if (store->count >= (size_t)1 << store->bucketBits) {
+	resize(store, store->bucketBits + 1);
+    }
+    size_t keyLength = strlen(key);
+    entry = malloc(sizeof(Entry) + keyLength + 1);
+    if (entry == NULL) {
+	free(newValue);
+	return 0;
+    }
+    memcpy(entry->key, key, keyLength + 1);
+    entry->value = newValue;
+    entry->version = version;
+    // Link the new entry at the head of its bucket
+    Entry** bucket = find_bucket(store, key);
+    entry->nextEntry = *bucket;
+    *bucket = entry;
+    store->count++;
+    return 1;
+}
+
+uint64_t stringstore_add_versioned(StringStore* store, const char* key,
+	const char* value) {
+    if (put_entry(store, key, value, store->version + 1) == 0) {
+	return 0;
+    }
+    return ++store->version;
+}
+
+int stringstore_add_at_version(StringStore* store, const char* key, 
+	const char* value, uint64_t version) {
+    if (put_entry(store, key, value, version) == 0) {
+	return 0;
+    }
+    stringstore_advance_version(store, version);
+    return 1;
+}
+
+uint64_t stringstore_version(StringStore* store) {
+    return store->version;
+}
+
+void stringstore_advance_version(StringStore* store, uint64_t version) {
+    if (version > store->version) {
+	store->version = version;
+    }
+}
+
+int stringstore_add(StringStore* store, const char* key, const char* value) {
+    return stringstore_add_versioned(store, key, value) != 0;
 }
 
 const char* stringstore_retrieve(StringStore* store, const char* key) {
-    // Disregard the head (NULL entry)
-    store = store->nextEntry;
-    // Goes through every entry and return the value if the key is found
-    while(store != NULL) {
-	if (strcmp(store->key, key) == 0) {
-	    return store->value;
+    Entry* entry = find_entry(store, key);
+    return entry == NULL ? NULL : entry->value;
+}
+
+const char* stringstore_retrieve_versioned(StringStore* store,
+	const char* key, uint64_t* version) {
+    Entry* entry = find_entry(store, key);
+    if (entry == NULL) {
+	*version = 0;
+	return NULL;
+    }
+    *version = entry->version;
+    return entry->value;
+}
+
+uint64_t stringstore_increment(StringStore* store, const char* key,
+	int64_t by, int64_t* result) {
+    char digits[INT64_DIGITS];
+    Entry* entry = find_entry(store, key);
+    // Missing keys count from 0
+    if (entry == NULL) {
+	*result = by;
+	sprintf(digits, "%" PRId64, by);
+	return stringstore_add_versioned(store, key, digits);
+    }
+
+    // The whole value must be a decimal integer
+    char* end;
+    errno = 0;
+    int64_t current = strtoll(entry->value, &end, 10);
+    if (entry->value[0] == '\0' || *end != '\0' || errno == ERANGE ||
+	    __builtin_add_overflow(current, by, result)) {
+	return 0;
+    }
+    size_t oldLength = strlen(entry->value);
+    size_t newLength = sprintf(digits, "%" PRId64, *result);
+    // Only reallocate if the value needs more digits than it has room for
+    if (newLength > oldLength) {
+	char* newValue = realloc((char*)entry->value, newLength + 1);
+	if (newValue == NULL) {
+	    return 0;
 	}
-	store = store->nextEntry;
+	entry->value = newValue;
     }
-    return NULL;
+    memcpy((char*)entry->value, digits, newLength + 1);
+    entry->version = ++store->version;
+    return entry->version;
 }
 
-int stringstore_delete(StringStore* store, const char* key) {
-    StringStore* currentEntry;
-    // Check if the given key exists
-    if (stringstore_retrieve(store, key) != NULL) {
-	while(store != NULL) {
-	    currentEntry = store;
-	    store = store->nextEntry;
-	    if (strcmp(store->key, key) == 0) {
-		currentEntry->nextEntry = store->nextEntry;
-		free((char*)store->key);
-		free((char*)store->value);
-		free(store);
-		return 1;
-	    }
+uint64_t stringstore_append(StringStore* store, const char* key,
+	const char* suffix) {
+    Entry* entry = find_entry(store, key);
+    if (entry == NULL) {
+	return stringstore_add_versioned(store, key, suffix);
+    }
+    size_t oldLength = strlen(entry->value);
+    size_t suffixLength = strlen(suffix);
+    char* newValue = realloc((char*)entry->value,
+	    oldLength + suffixLength + 1);
+    if (newValue == NULL) {
+	return 0;
+    }
+    memcpy(newValue + oldLength, suffix, suffixLength + 1);
+    entry->value = newValue;
+    entry->version = ++store->version;
+    return entry->version;
+}
+
+void stringstore_foreach(StringStore* store, StringStoreVisitor visit,
+	void* arg) {
+    for (size_t i = 0; i < (size_t)1 << store->bucketBits; i++) {
+	for (Entry* entry = store->buckets[i]; entry != NULL;
+		entry = entry->nextEntry) {
+	    visit(entry->key, entry->value, entry->version, arg);
 	}
     }
-    return 0;
 }
 
+uint64_t stringstore_scan(StringStore* store, uint64_t cursor, 
+	size_t buckets, StringStoreVisitor visit, void* arg) {
+    // The cursor is the lowest hash not yet visited, which stays valid if 
+    // the table doubles between calls
+    size_t bucketCount = (size_t)1 << store->bucketBits;
+    size_t bucket = bucket_index(cursor, store->bucketBits);
+    for (; buckets > 0 && bucket < bucketCount; bucket++, buckets--) {
+	// Entries are spread over the heap, so fetch them ahead of time
+	if (bucket + SCAN_PREFETCH_DISTANCE < bucketCount) {
+	    __builtin_prefetch(
+		    store->buckets[bucket + SCAN_PREFETCH_DISTANCE]);
+	}
+	for (Entry* entry = store->buckets[bucket]; entry != NULL;
+		entry = entry->nextEntry) {
+	    visit(entry->key, entry->value, entry->version, arg);
+	}
+    }
+    return bucket == bucketCount ? 0 : 
+	    (uint64_t)bucket << (HASH_BITS - store->bucketBits);
+}
 
+int stringstore_delete(StringStore* store, const char* key) {
+    Entry** link = find_bucket(store, key);
+    while (*link != NULL) {
+	Entry* entry = *link;
+	if (strcmp(entry->key, key) == 0) {
+	    *link = entry->nextEntry;
+	    free((char*)entry->value);
+	    free(entry);
+	    store->count--;
+	    return 1;
+	}
+	link = &entry->nextEntry;
+    }
+    return 0;
+}
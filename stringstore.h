@@ -0,0 +1,86 @@
+#ifndef STRINGSTORE_H
+#define STRINGSTORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* A database to store keys and their respective string values */
+typedef struct StringStore StringStore;
+
+/* Creates an empty store */
+StringStore* stringstore_init(void);
+
+/* Frees the store and everything in it. Returns NULL. */
+StringStore* stringstore_free(StringStore* store);
+
+/* Stores a copy of the key and value, replacing any existing value for the
+ * key. Returns 1 on success, 0 on failure. */
+int stringstore_add(StringStore* store, const char* key, const char* value);
+
+/* Returns the value stored for the key, NULL if there is none */
+const char* stringstore_retrieve(StringStore* store, const char* key);
+
+/* Deletes the key and its value. Returns 1 if it existed, 0 otherwise. */
+int stringstore_delete(StringStore* store, const char* key);
+
+/* As stringstore_add(), returning the new version of the key, or 0 on 
+ * failure. Every successful add gives the key a version greater than any
+ * version previously issued by the store. */
+uint64_t stringstore_add_versioned(StringStore* store, const char* key, 
+	const char* value);
+
+/* Stores a copy of the key and value at the given version, as copied from
+ * another store, replacing any existing value for the key. Versions later
+ * issued by the store are greater. Returns 1 on success, 0 on failure. */
+int stringstore_add_at_version(StringStore* store, const char* key, 
+	const char* value, uint64_t version);
+
+/* Returns the latest version issued by the store, 0 if none */
+uint64_t stringstore_version(StringStore* store);
+
+/* Makes every version later issued by the store greater than version */
+void stringstore_advance_version(StringStore* store, uint64_t version);
+
+/* As stringstore_retrieve(), also setting version to the version the key 
+ * was last written at (0 if the key does not exist) */
+const char* stringstore_retrieve_versioned(StringStore* store, 
+	const char* key, uint64_t* version);
+
+/* Adds by to the integer value of the key, storing the sum in result. A
+ * missing key counts as 0. The value is updated in place unless it needs 
+ * more digits. Returns the new version of the key, or 0 if the value is 
+ * not a decimal integer or the sum would overflow. */
+uint64_t stringstore_increment(StringStore* store, const char* key, 
+	int64_t by, int64_t* result);
+
+/* Appends suffix to the value of the key, creating the key if it is 
+ * missing. Returns the new version of the key, or 0 on failure. */
+uint64_t stringstore_append(StringStore* store, const char* key, 
+	const char* suffix);
+
+/* Function called for each key/value pair, with the version the key was 
+ * last written at, by stringstore_foreach() and stringstore_scan() */
+typedef void (*StringStoreVisitor)(const char* key, const char* value, 
+	uint64_t version, void* arg);
+
+/* Calls visit for every key/value pair in the store, passing arg along. 
+ * The store must not be modified until stringstore_foreach() returns. */
+void stringstore_foreach(StringStore* store, StringStoreVisitor visit, 
+	void* arg);
+
+/* Calls visit for the key/value pairs in up to buckets hash buckets of the
+ * store, starting from cursor (0 to start a scan). Returns the cursor to 
+ * continue the scan from, or 0 once the scan is complete. The store may be
+ * modified between calls: keys present for the whole scan are visited 
+ * exactly once, while keys added or deleted during it may not be. */
+uint64_t stringstore_scan(StringStore* store, uint64_t cursor, 
+	size_t buckets, StringStoreVisitor visit, void* arg);
+
+/* Makes room for count keys, so adding them needs no resizing. Returns 1 
+ * on success, 0 on failure. */
+int stringstore_reserve(StringStore* store, size_t count);
+
+/* Returns the number of keys in the store */
+size_t stringstore_count(StringStore* store);
+
+#endif